@@ -0,0 +1,186 @@
+#include "backend.h"
+
+using namespace std;
+
+GPhotoBackend::GPhotoBackend() : camera_(nullptr), abilities_(nullptr) {
+    context_ = gp_context_new();
+    if (gp_camera_new(&camera_) != GP_OK) {
+        camera_ = nullptr;
+        return;
+    }
+    gp_abilities_list_new(&abilities_);
+    gp_abilities_list_load(abilities_, context_);
+}
+
+GPhotoBackend::~GPhotoBackend() {
+    if (abilities_) gp_abilities_list_free(abilities_);
+    if (camera_) gp_camera_unref(camera_);
+    if (context_) gp_context_unref(context_);
+}
+
+int GPhotoBackend::list(const string& path, bool folders,
+        set<string> *names) {
+    CameraList *list = NULL;
+    gp_list_new(&list);
+    int ret;
+    if (folders) {
+        ret = gp_camera_folder_list_folders(camera_, path.c_str(), list,
+                context_);
+    } else {
+        ret = gp_camera_folder_list_files(camera_, path.c_str(), list,
+                context_);
+    }
+    if (ret == GP_OK) {
+        for (int i = 0; i < gp_list_count(list); i++) {
+            const char *name;
+            gp_list_get_name(list, i, &name);
+            names->insert(name);
+        }
+    }
+    gp_list_free(list);
+    return ret;
+}
+
+int GPhotoBackend::listFolders(const string& path, set<string> *names) {
+    return list(path, true, names);
+}
+
+int GPhotoBackend::listFiles(const string& path, set<string> *names) {
+    return list(path, false, names);
+}
+
+int GPhotoBackend::getInfo(const string& folder, const string& name,
+        CameraFileInfo *info) {
+    return gp_camera_file_get_info(camera_, folder.c_str(), name.c_str(),
+            info, context_);
+}
+
+int GPhotoBackend::getFile(const string& folder, const string& name,
+        CameraFileType type, CameraFile *file) {
+    return gp_camera_file_get(camera_, folder.c_str(), name.c_str(), type,
+            file, context_);
+}
+
+int GPhotoBackend::readFile(const string& folder, const string& name,
+        uint64_t offset, char *buf, uint64_t *size) {
+    return gp_camera_file_read(camera_, folder.c_str(), name.c_str(),
+            GP_FILE_TYPE_NORMAL, offset, buf, size, context_);
+}
+
+int GPhotoBackend::putFile(const string& folder, const string& name,
+        CameraFile *file) {
+    return gp_camera_folder_put_file(camera_, folder.c_str(), name.c_str(),
+            GP_FILE_TYPE_NORMAL, file, context_);
+}
+
+int GPhotoBackend::deleteFile(const string& folder, const string& name) {
+    return gp_camera_file_delete(camera_, folder.c_str(), name.c_str(),
+            context_);
+}
+
+int GPhotoBackend::makeDir(const string& parent, const string& name) {
+    return gp_camera_folder_make_dir(camera_, parent.c_str(), name.c_str(),
+            context_);
+}
+
+int GPhotoBackend::removeDir(const string& parent, const string& name) {
+    return gp_camera_folder_remove_dir(camera_, parent.c_str(), name.c_str(),
+            context_);
+}
+
+int GPhotoBackend::storageInfo(CameraStorageInformation **info,
+        int *count) {
+    return gp_camera_get_storageinfo(camera_, info, count, context_);
+}
+
+int GPhotoBackend::summary(string *text) {
+    CameraText summary;
+    int ret = gp_camera_get_summary(camera_, &summary, context_);
+    if (ret == GP_OK) *text = summary.text;
+    return ret;
+}
+
+int GPhotoBackend::waitForEvent(int timeout, CameraEventType *type,
+        void **data) {
+    return gp_camera_wait_for_event(camera_, timeout, type, data, context_);
+}
+
+TimedBackend::TimedBackend(CameraBackend *backend, Stats *stats)
+        : backend_(backend), stats_(stats) {
+}
+
+TimedBackend::Call::Call(Stats *stats, StatCall call, const string& path,
+        const char *child, uint64_t bytes)
+        : stats_(stats), timer_(stats->call(call)),
+          trace_("camera", StatCallName(call), path.c_str(), child, bytes) {
+    stats_->callsRunning++;
+}
+
+TimedBackend::Call::~Call() {
+    stats_->callsRunning--;
+}
+
+int TimedBackend::listFolders(const string& path, set<string> *names) {
+    Call call(stats_, CALL_LIST_FOLDERS, path);
+    return backend_->listFolders(path, names);
+}
+
+int TimedBackend::listFiles(const string& path, set<string> *names) {
+    Call call(stats_, CALL_LIST_FILES, path);
+    return backend_->listFiles(path, names);
+}
+
+int TimedBackend::getInfo(const string& folder, const string& name,
+        CameraFileInfo *info) {
+    Call call(stats_, CALL_GET_INFO, folder, name.c_str());
+    return backend_->getInfo(folder, name, info);
+}
+
+int TimedBackend::getFile(const string& folder, const string& name,
+        CameraFileType type, CameraFile *file) {
+    Call call(stats_, CALL_GET_FILE, folder, name.c_str());
+    return backend_->getFile(folder, name, type, file);
+}
+
+int TimedBackend::readFile(const string& folder, const string& name,
+        uint64_t offset, char *buf, uint64_t *size) {
+    Call call(stats_, CALL_READ_FILE, folder, name.c_str(), *size);
+    return backend_->readFile(folder, name, offset, buf, size);
+}
+
+int TimedBackend::putFile(const string& folder, const string& name,
+        CameraFile *file) {
+    Call call(stats_, CALL_PUT_FILE, folder, name.c_str());
+    return backend_->putFile(folder, name, file);
+}
+
+int TimedBackend::deleteFile(const string& folder, const string& name) {
+    Call call(stats_, CALL_DELETE_FILE, folder, name.c_str());
+    return backend_->deleteFile(folder, name);
+}
+
+int TimedBackend::makeDir(const string& parent, const string& name) {
+    Call call(stats_, CALL_MAKE_DIR, parent, name.c_str());
+    return backend_->makeDir(parent, name);
+}
+
+int TimedBackend::removeDir(const string& parent, const string& name) {
+    Call call(stats_, CALL_REMOVE_DIR, parent, name.c_str());
+    return backend_->removeDir(parent, name);
+}
+
+int TimedBackend::storageInfo(CameraStorageInformation **info, int *count) {
+    Call call(stats_, CALL_STORAGE_INFO, "/");
+    return backend_->storageInfo(info, count);
+}
+
+int TimedBackend::summary(string *text) {
+    Call call(stats_, CALL_SUMMARY, "/");
+    return backend_->summary(text);
+}
+
+int TimedBackend::waitForEvent(int timeout, CameraEventType *type,
+        void **data) {
+    Call call(stats_, CALL_WAIT_FOR_EVENT, "/");
+    return backend_->waitForEvent(timeout, type, data);
+}
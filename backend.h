@@ -0,0 +1,137 @@
+#ifndef __GPHOTOFS2_BACKEND_H_
+#define __GPHOTOFS2_BACKEND_H_
+
+#include <cstdint>
+#include <memory>
+#include <set>
+#include <string>
+#include <gphoto2/gphoto2.h>
+
+#include "stats.h"
+#include "trace.h"
+
+/*
+ * The camera, as the filesystem sees it. Calls mirror the libgphoto2 ones
+ * and return GP_* results; they are only made from the camera thread.
+ * Contents are transferred through CameraFiles, so that they can be
+ * streamed by handlers.
+ */
+class CameraBackend {
+public:
+    virtual ~CameraBackend() {}
+
+    virtual int listFolders(const std::string& path,
+            std::set<std::string> *names) = 0;
+    virtual int listFiles(const std::string& path,
+            std::set<std::string> *names) = 0;
+    virtual int getInfo(const std::string& folder, const std::string& name,
+            CameraFileInfo *info) = 0;
+    virtual int getFile(const std::string& folder, const std::string& name,
+            CameraFileType type, CameraFile *file) = 0;
+    // Reads up to *size bytes at offset, and sets *size to what was read.
+    virtual int readFile(const std::string& folder, const std::string& name,
+            uint64_t offset, char *buf, uint64_t *size) = 0;
+    virtual int putFile(const std::string& folder, const std::string& name,
+            CameraFile *file) = 0;
+    virtual int deleteFile(const std::string& folder,
+            const std::string& name) = 0;
+    virtual int makeDir(const std::string& parent,
+            const std::string& name) = 0;
+    virtual int removeDir(const std::string& parent,
+            const std::string& name) = 0;
+    // *info is allocated with malloc(), free() it.
+    virtual int storageInfo(CameraStorageInformation **info, int *count) = 0;
+    virtual int summary(std::string *text) = 0;
+    // *data is allocated with malloc() or null, free() it.
+    virtual int waitForEvent(int timeout, CameraEventType *type,
+            void **data) = 0;
+    // Calls made and bytes transferred so far as "calls=N bytes=N", or empty
+    // if the backend does not count them. Unlike the calls above, it may be
+    // called from any thread, so the counts must be atomic.
+    virtual std::string counters() { return std::string(); }
+};
+
+// A camera on USB, through libgphoto2.
+class GPhotoBackend : public CameraBackend {
+public:
+    GPhotoBackend();
+    ~GPhotoBackend() override;
+
+    int listFolders(const std::string& path,
+            std::set<std::string> *names) override;
+    int listFiles(const std::string& path,
+            std::set<std::string> *names) override;
+    int getInfo(const std::string& folder, const std::string& name,
+            CameraFileInfo *info) override;
+    int getFile(const std::string& folder, const std::string& name,
+            CameraFileType type, CameraFile *file) override;
+    int readFile(const std::string& folder, const std::string& name,
+            uint64_t offset, char *buf, uint64_t *size) override;
+    int putFile(const std::string& folder, const std::string& name,
+            CameraFile *file) override;
+    int deleteFile(const std::string& folder,
+            const std::string& name) override;
+    int makeDir(const std::string& parent, const std::string& name) override;
+    int removeDir(const std::string& parent,
+            const std::string& name) override;
+    int storageInfo(CameraStorageInformation **info, int *count) override;
+    int summary(std::string *text) override;
+    int waitForEvent(int timeout, CameraEventType *type,
+            void **data) override;
+
+private:
+    int list(const std::string& path, bool folders,
+            std::set<std::string> *names);
+
+    Camera *camera_;
+    GPContext *context_;
+    CameraAbilitiesList *abilities_;
+};
+
+// Wraps another backend, timing each call into stats.
+class TimedBackend : public CameraBackend {
+public:
+    TimedBackend(CameraBackend *backend, Stats *stats);
+
+    int listFolders(const std::string& path,
+            std::set<std::string> *names) override;
+    int listFiles(const std::string& path,
+            std::set<std::string> *names) override;
+    int getInfo(const std::string& folder, const std::string& name,
+            CameraFileInfo *info) override;
+    int getFile(const std::string& folder, const std::string& name,
+            CameraFileType type, CameraFile *file) override;
+    int readFile(const std::string& folder, const std::string& name,
+            uint64_t offset, char *buf, uint64_t *size) override;
+    int putFile(const std::string& folder, const std::string& name,
+            CameraFile *file) override;
+    int deleteFile(const std::string& folder,
+            const std::string& name) override;
+    int makeDir(const std::string& parent, const std::string& name) override;
+    int removeDir(const std::string& parent,
+            const std::string& name) override;
+    int storageInfo(CameraStorageInformation **info, int *count) override;
+    int summary(std::string *text) override;
+    int waitForEvent(int timeout, CameraEventType *type,
+            void **data) override;
+    std::string counters() override { return backend_->counters(); }
+
+private:
+    // Times and traces a call, and counts it as running meanwhile.
+    class Call {
+    public:
+        Call(Stats *stats, StatCall call, const std::string& path,
+                const char *child = nullptr, uint64_t bytes = 0);
+        ~Call();
+
+    private:
+        Stats *stats_;
+        StatTimer timer_;
+        TraceScope trace_;
+    };
+
+    std::unique_ptr<CameraBackend> backend_;
+    Stats *stats_;
+};
+
+#endif // __GPHOTOFS2_BACKEND_H_
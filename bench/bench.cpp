@@ -0,0 +1,525 @@
+/*
+ * Mount-level benchmark: mounts gphotofs2 over the simulated camera, runs
+ * scripted workloads through the kernel, and prints the results as JSON.
+ *
+ * Usage: gphotofs2-bench [options]
+ *   -b, --binary PATH      gphotofs2 to mount with (./gphotofs2)
+ *   -m, --mount DIR        mountpoint (a temporary dir)
+ *   -o, --options OPTS     more mount options, e.g. lowlevel,readahead=0
+ *       --folders N        DCIM folders on the simulated card (2)
+ *       --files N          files in each folder (2000)
+ *       --file-size KIB    size of each file (1024)
+ *       --latency US       latency of each camera call (2000)
+ *       --bandwidth KIBPS  camera transfer rate (20000)
+ *   -j, --threads N        threads for the stat storm and parallel reads (4)
+ *       --seq-files N      files read whole, one after another (16)
+ *       --random-reads N   4 KiB reads at random offsets (500)
+ *       --copy-files N     files written into a new folder (8)
+ */
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const char kStorage[] = "store_00010001";
+static const char kCountersXattr[] = "user.gphotofs2.camera";
+static const size_t kReadSize = 128 * 1024;
+static const size_t kRandomReadSize = 4096;
+
+struct Config {
+    string binary = "./gphotofs2";
+    string mount;
+    string options;
+    unsigned long folders = 2;
+    unsigned long files = 2000;
+    unsigned long fileSize = 1024;
+    unsigned long latency = 2000;
+    unsigned long bandwidth = 20000;
+    unsigned long threads = 4;
+    unsigned long seqFiles = 16;
+    unsigned long randomReads = 500;
+    unsigned long copyFiles = 8;
+};
+
+// Calls made to the simulated camera, and bytes transferred.
+struct Counters {
+    unsigned long long calls = 0;
+    unsigned long long bytes = 0;
+};
+
+struct Result {
+    string name;
+    // latency of every op in microseconds
+    vector<double> latencies;
+    unsigned long errors = 0;
+    uint64_t bytes = 0;
+    double seconds = 0;
+    Counters camera;
+};
+
+typedef chrono::steady_clock Clock;
+
+static double Elapsed(Clock::time_point start) {
+    return chrono::duration<double>(Clock::now() - start).count();
+}
+
+static void Fail(const string& msg) {
+    fprintf(stderr, "gphotofs2-bench: %s\n", msg.c_str());
+    exit(1);
+}
+
+static Counters ReadCounters(const Config& config) {
+    Counters counters;
+    char buf[128];
+    ssize_t len = getxattr(config.mount.c_str(), kCountersXattr, buf,
+            sizeof(buf) - 1);
+    if (len < 0) return counters;
+    buf[len] = '\0';
+    sscanf(buf, "calls=%llu bytes=%llu", &counters.calls, &counters.bytes);
+    return counters;
+}
+
+/*
+ * Runs a workload, timing it as a whole and taking the camera counters
+ * before and after.
+ */
+static Result Measure(const string& name, const Config& config,
+        const function<void(Result*)>& workload) {
+    Result result;
+    result.name = name;
+    Counters before = ReadCounters(config);
+    Clock::time_point start = Clock::now();
+    workload(&result);
+    result.seconds = Elapsed(start);
+    Counters after = ReadCounters(config);
+    result.camera.calls = after.calls - before.calls;
+    result.camera.bytes = after.bytes - before.bytes;
+    fprintf(stderr, "%s: %zu ops, %.3f s\n", name.c_str(),
+            result.latencies.size(), result.seconds);
+    return result;
+}
+
+// Runs fn(i) for i in [0, count) on the given number of threads.
+static void Parallel(unsigned long threads, size_t count, Result *result,
+        const function<void(size_t, Result*)>& fn) {
+    vector<Result> parts(max(threads, 1UL));
+    vector<thread> workers;
+    atomic<size_t> next(0);
+    for (Result& part : parts) {
+        workers.emplace_back([&] {
+            for (size_t i = next++; i < count; i = next++) fn(i, &part);
+        });
+    }
+    for (thread& worker : workers) worker.join();
+    for (Result& part : parts) {
+        result->latencies.insert(result->latencies.end(),
+                part.latencies.begin(), part.latencies.end());
+        result->errors += part.errors;
+        result->bytes += part.bytes;
+    }
+}
+
+/*
+ * Workloads
+ */
+
+// Lists a dir, returning the names in it; one op.
+static vector<string> ListDir(const string& path, Result *result) {
+    vector<string> names;
+    Clock::time_point start = Clock::now();
+    DIR *dir = opendir(path.c_str());
+    if (dir == nullptr) {
+        result->errors++;
+        return names;
+    }
+    while (struct dirent *entry = readdir(dir)) {
+        if (strcmp(entry->d_name, ".") == 0 ||
+                strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        names.push_back(entry->d_name);
+    }
+    closedir(dir);
+    result->latencies.push_back(Elapsed(start) * 1e6);
+    return names;
+}
+
+// Lists DCIM and every folder in it, collecting the paths of the files.
+static void ListTree(const string& dcim, vector<string> *files,
+        Result *result) {
+    vector<string> folders = ListDir(dcim, result);
+    sort(folders.begin(), folders.end());
+    for (const string& folder : folders) {
+        string path = dcim + "/" + folder;
+        vector<string> names = ListDir(path, result);
+        sort(names.begin(), names.end());
+        if (files == nullptr) continue;
+        for (const string& name : names) files->push_back(path + "/" + name);
+    }
+}
+
+static void StatFile(const string& path, Result *result) {
+    struct stat st;
+    Clock::time_point start = Clock::now();
+    if (stat(path.c_str(), &st) != 0) {
+        result->errors++;
+        return;
+    }
+    result->latencies.push_back(Elapsed(start) * 1e6);
+}
+
+// Reads a file from start to end; every read() is an op.
+static void ReadFile(const string& path, Result *result) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        result->errors++;
+        return;
+    }
+    vector<char> buf(kReadSize);
+    while (true) {
+        Clock::time_point start = Clock::now();
+        ssize_t len = read(fd, buf.data(), buf.size());
+        if (len < 0) {
+            result->errors++;
+            break;
+        }
+        result->latencies.push_back(Elapsed(start) * 1e6);
+        result->bytes += len;
+        if (len == 0) break;
+    }
+    close(fd);
+}
+
+static void RandomReads(const vector<string>& files, const Config& config,
+        Result *result) {
+    mt19937_64 random(1);
+    uint64_t fileSize = (uint64_t)config.fileSize << 10;
+    vector<char> buf(kRandomReadSize);
+    for (unsigned long i = 0; i < config.randomReads; i++) {
+        const string& path = files[random() % files.size()];
+        off_t offset = fileSize > kRandomReadSize ?
+            random() % (fileSize - kRandomReadSize) : 0;
+        Clock::time_point start = Clock::now();
+        int fd = open(path.c_str(), O_RDONLY);
+        ssize_t len = fd < 0 ? -1 : pread(fd, buf.data(), buf.size(), offset);
+        if (fd >= 0) close(fd);
+        if (len < 0) {
+            result->errors++;
+            continue;
+        }
+        result->latencies.push_back(Elapsed(start) * 1e6);
+        result->bytes += len;
+    }
+}
+
+// Writes a file and waits for it to reach the camera; one op.
+static void CopyIn(const string& path, const Config& config, Result *result) {
+    vector<char> buf(kReadSize);
+    for (size_t i = 0; i < buf.size(); i++) buf[i] = (char)(i * 131);
+    uint64_t size = (uint64_t)config.fileSize << 10;
+
+    Clock::time_point start = Clock::now();
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        result->errors++;
+        return;
+    }
+    bool ok = true;
+    for (uint64_t done = 0; ok && done < size; ) {
+        size_t len = min((uint64_t)buf.size(), size - done);
+        ok = write(fd, buf.data(), len) == (ssize_t)len;
+        done += len;
+    }
+    ok = fsync(fd) == 0 && ok;
+    ok = close(fd) == 0 && ok;
+    if (!ok) {
+        result->errors++;
+        return;
+    }
+    result->latencies.push_back(Elapsed(start) * 1e6);
+    result->bytes += size;
+}
+
+// Files [first, first + count) of the tree, wrapping around.
+static vector<string> Slice(const vector<string>& files, size_t first,
+        size_t count) {
+    vector<string> slice;
+    for (size_t i = 0; i < count && !files.empty(); i++) {
+        slice.push_back(files[(first + i) % files.size()]);
+    }
+    return slice;
+}
+
+static vector<Result> RunWorkloads(const Config& config) {
+    string dcim = config.mount + "/" + kStorage + "/DCIM";
+    vector<Result> results;
+    vector<string> files;
+
+    results.push_back(Measure("readdir_cold", config, [&](Result *r) {
+        ListTree(dcim, &files, r);
+    }));
+    results.push_back(Measure("readdir_warm", config, [&](Result *r) {
+        ListTree(dcim, nullptr, r);
+    }));
+    if (files.empty()) {
+        fprintf(stderr, "gphotofs2-bench: no files found under %s\n",
+                dcim.c_str());
+        return results;
+    }
+
+    results.push_back(Measure("stat_storm", config, [&](Result *r) {
+        Parallel(config.threads, files.size(), r, [&](size_t i, Result *p) {
+            StatFile(files[i], p);
+        });
+    }));
+
+    // Every read workload gets files the others have not read.
+    size_t next = 0;
+    vector<string> seqFiles = Slice(files, next, config.seqFiles);
+    next += seqFiles.size();
+    results.push_back(Measure("sequential_read", config, [&](Result *r) {
+        for (const string& path : seqFiles) ReadFile(path, r);
+    }));
+
+    size_t randomFiles = max(config.randomReads / 8, 1UL);
+    vector<string> randomSet = Slice(files, next, randomFiles);
+    next += randomSet.size();
+    results.push_back(Measure("random_read", config, [&](Result *r) {
+        RandomReads(randomSet, config, r);
+    }));
+
+    vector<string> parallelFiles = Slice(files, next,
+            config.threads * max(config.seqFiles / 4, 1UL));
+    results.push_back(Measure("parallel_read", config, [&](Result *r) {
+        Parallel(config.threads, parallelFiles.size(), r,
+                [&](size_t i, Result *p) { ReadFile(parallelFiles[i], p); });
+    }));
+
+    string folder = dcim + "/999BENCH";
+    if (mkdir(folder.c_str(), 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "gphotofs2-bench: cannot create %s: %s\n",
+                folder.c_str(), strerror(errno));
+        return results;
+    }
+    results.push_back(Measure("copy_in", config, [&](Result *r) {
+        for (unsigned long i = 0; i < config.copyFiles; i++) {
+            char name[32];
+            snprintf(name, sizeof(name), "/BNCH%04lu.JPG", i);
+            CopyIn(folder + name, config, r);
+        }
+    }));
+    return results;
+}
+
+/*
+ * Mounting
+ */
+
+static bool Mounted(const string& path) {
+    struct stat st, parent;
+    if (stat(path.c_str(), &st) != 0) return false;
+    if (stat((path + "/..").c_str(), &parent) != 0) return false;
+    return st.st_dev != parent.st_dev;
+}
+
+static pid_t Mount(const Config& config) {
+    char opts[512];
+    snprintf(opts, sizeof(opts), "simulate,sim_folders=%lu,sim_files=%lu,"
+            "sim_file_size=%lu,sim_latency=%lu,sim_bandwidth=%lu%s%s",
+            config.folders, config.files, config.fileSize, config.latency,
+            config.bandwidth, config.options.empty() ? "" : ",",
+            config.options.c_str());
+
+    pid_t pid = fork();
+    if (pid < 0) Fail(string("fork: ") + strerror(errno));
+    if (pid == 0) {
+        execl(config.binary.c_str(), config.binary.c_str(), "-f", "-o", opts,
+                config.mount.c_str(), (char *)nullptr);
+        fprintf(stderr, "gphotofs2-bench: cannot run %s: %s\n",
+                config.binary.c_str(), strerror(errno));
+        _exit(127);
+    }
+
+    for (int i = 0; i < 1000; i++) {
+        if (Mounted(config.mount)) return pid;
+        int status;
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            Fail("gphotofs2 exited before mounting");
+        }
+        usleep(10000);
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+    Fail("timed out waiting for the mount");
+    return -1;
+}
+
+static void Unmount(const Config& config, pid_t pid) {
+    pid_t child = fork();
+    if (child == 0) {
+        execlp("fusermount", "fusermount", "-u", config.mount.c_str(),
+                (char *)nullptr);
+        _exit(127);
+    }
+    int status = 0;
+    if (child > 0) waitpid(child, &status, 0);
+    if (child < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "gphotofs2-bench: fusermount failed, killing\n");
+        kill(pid, SIGTERM);
+    }
+    waitpid(pid, nullptr, 0);
+}
+
+// Peak resident set of a process in KiB, or 0 if unknown.
+static unsigned long PeakRss(pid_t pid) {
+    string path = "/proc/" + to_string(pid) + "/status";
+    FILE *status = fopen(path.c_str(), "r");
+    if (status == nullptr) return 0;
+    char line[256];
+    unsigned long kib = 0;
+    while (fgets(line, sizeof(line), status) != nullptr) {
+        if (sscanf(line, "VmHWM: %lu kB", &kib) == 1) break;
+    }
+    fclose(status);
+    return kib;
+}
+
+/*
+ * Output
+ */
+
+static double Percentile(const vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t rank = (size_t)(p / 100 * sorted.size());
+    return sorted[min(rank, sorted.size() - 1)];
+}
+
+static string Quote(const string& s) {
+    string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') out.push_back('\\');
+        out.push_back(c);
+    }
+    return out + "\"";
+}
+
+static void PrintJson(const Config& config, const vector<Result>& results,
+        unsigned long peakRss) {
+    printf("{\n  \"config\": {\"folders\": %lu, \"files\": %lu, "
+            "\"file_size_kib\": %lu, \"latency_us\": %lu, "
+            "\"bandwidth_kibps\": %lu, \"threads\": %lu, \"options\": %s},\n",
+            config.folders, config.files, config.fileSize, config.latency,
+            config.bandwidth, config.threads, Quote(config.options).c_str());
+    printf("  \"workloads\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        vector<double> sorted = r.latencies;
+        sort(sorted.begin(), sorted.end());
+        double seconds = max(r.seconds, 1e-9);
+        printf("    {\"name\": %s, \"ops\": %zu, \"errors\": %lu, "
+                "\"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+                "\"bytes\": %llu, \"mib_per_sec\": %.3f,\n"
+                "     \"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, "
+                "\"p99\": %.1f, \"max\": %.1f},\n"
+                "     \"camera\": {\"calls\": %llu, \"bytes\": %llu}}%s\n",
+                Quote(r.name).c_str(), sorted.size(), r.errors, r.seconds,
+                sorted.size() / seconds, (unsigned long long)r.bytes,
+                r.bytes / seconds / (1 << 20), Percentile(sorted, 50),
+                Percentile(sorted, 90), Percentile(sorted, 99),
+                sorted.empty() ? 0 : sorted.back(), r.camera.calls,
+                r.camera.bytes, i + 1 < results.size() ? "," : "");
+    }
+    printf("  ],\n  \"peak_rss_kib\": %lu\n}\n", peakRss);
+}
+
+static void Usage() {
+    fprintf(stderr, "usage: gphotofs2-bench [-b binary] [-m mountpoint] "
+            "[-o options] [-j threads]\n"
+            "    [--folders N] [--files N] [--file-size KIB] "
+            "[--latency US] [--bandwidth KIBPS]\n"
+            "    [--seq-files N] [--random-reads N] [--copy-files N]\n");
+    exit(2);
+}
+
+enum {
+    OPT_FOLDERS = 256, OPT_FILES, OPT_FILE_SIZE, OPT_LATENCY, OPT_BANDWIDTH,
+    OPT_SEQ_FILES, OPT_RANDOM_READS, OPT_COPY_FILES,
+};
+
+int main(int argc, char *argv[]) {
+    static const struct option longOptions[] = {
+        {"binary", required_argument, nullptr, 'b'},
+        {"mount", required_argument, nullptr, 'm'},
+        {"options", required_argument, nullptr, 'o'},
+        {"threads", required_argument, nullptr, 'j'},
+        {"folders", required_argument, nullptr, OPT_FOLDERS},
+        {"files", required_argument, nullptr, OPT_FILES},
+        {"file-size", required_argument, nullptr, OPT_FILE_SIZE},
+        {"latency", required_argument, nullptr, OPT_LATENCY},
+        {"bandwidth", required_argument, nullptr, OPT_BANDWIDTH},
+        {"seq-files", required_argument, nullptr, OPT_SEQ_FILES},
+        {"random-reads", required_argument, nullptr, OPT_RANDOM_READS},
+        {"copy-files", required_argument, nullptr, OPT_COPY_FILES},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    Config config;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "b:m:o:j:", longOptions,
+                    nullptr)) != -1) {
+        unsigned long value = optarg ? strtoul(optarg, nullptr, 10) : 0;
+        switch (opt) {
+        case 'b': config.binary = optarg; break;
+        case 'm': config.mount = optarg; break;
+        case 'o': config.options = optarg; break;
+        case 'j': config.threads = max(value, 1UL); break;
+        case OPT_FOLDERS: config.folders = value; break;
+        case OPT_FILES: config.files = value; break;
+        case OPT_FILE_SIZE: config.fileSize = value; break;
+        case OPT_LATENCY: config.latency = value; break;
+        case OPT_BANDWIDTH: config.bandwidth = value; break;
+        case OPT_SEQ_FILES: config.seqFiles = value; break;
+        case OPT_RANDOM_READS: config.randomReads = value; break;
+        case OPT_COPY_FILES: config.copyFiles = value; break;
+        default: Usage();
+        }
+    }
+    if (optind != argc) Usage();
+
+    bool tempMount = config.mount.empty();
+    if (tempMount) {
+        char dir[] = "/tmp/gphotofs2-bench.XXXXXX";
+        if (mkdtemp(dir) == nullptr) {
+            Fail(string("mkdtemp: ") + strerror(errno));
+        }
+        config.mount = dir;
+    }
+
+    pid_t pid = Mount(config);
+    vector<Result> results = RunWorkloads(config);
+    unsigned long peakRss = PeakRss(pid);
+    Unmount(config, pid);
+    if (tempMount) rmdir(config.mount.c_str());
+
+    PrintJson(config, results, peakRss);
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include "cache.h"
+#include "utils.h"
+#include "log.h"
+
+using namespace std;
+
+const size_t BlockCache::kBlockSize;
+
+BlockCache::BlockCache(size_t budget) : budget_(budget), used_(0) {
+}
+
+shared_ptr<Block> BlockCache::get(const void *owner, uint64_t index) {
+    lock_guard<mutex> guard(lock_);
+    auto it = blocks_.find(Key(owner, index));
+    if (it == blocks_.end()) return nullptr;
+    Entry& entry = it->second;
+    if (entry.inLru) {
+        lru_.splice(lru_.begin(), lru_, entry.lru);
+    }
+    return entry.block;
+}
+
+void BlockCache::put(const void *owner, uint64_t index,
+        shared_ptr<Block> block) {
+    lock_guard<mutex> guard(lock_);
+    Key key(owner, index);
+    auto it = blocks_.find(key);
+    if (it == blocks_.end()) {
+        Entry entry;
+        entry.bytes = 0;
+        entry.inLru = false;
+        it = blocks_.insert(make_pair(key, entry)).first;
+    } else {
+        unlink(it->second);
+    }
+
+    Entry& entry = it->second;
+    entry.block = block;
+    used_ += block->data.size();
+    entry.bytes = block->data.size();
+    if (!block->dirty) {
+        lru_.push_front(key);
+        entry.lru = lru_.begin();
+        entry.inLru = true;
+    }
+    evict();
+}
+
+void BlockCache::clean(const void *owner) {
+    lock_guard<mutex> guard(lock_);
+    for (auto it = blocks_.lower_bound(Key(owner, 0));
+            it != blocks_.end() && it->first.first == owner; it++) {
+        Entry& entry = it->second;
+        entry.block->dirty = false;
+        if (!entry.inLru) {
+            lru_.push_front(it->first);
+            entry.lru = lru_.begin();
+            entry.inLru = true;
+        }
+    }
+    evict();
+}
+
+void BlockCache::drop(const void *owner, uint64_t from) {
+    lock_guard<mutex> guard(lock_);
+    auto it = blocks_.lower_bound(Key(owner, from));
+    while (it != blocks_.end() && it->first.first == owner) {
+        unlink(it->second);
+        it = blocks_.erase(it);
+    }
+}
+
+size_t BlockCache::used() {
+    lock_guard<mutex> guard(lock_);
+    return used_;
+}
+
+// Removes the entry from the accounting, the caller erases or refills it.
+void BlockCache::unlink(Entry& entry) {
+    used_ -= entry.bytes;
+    entry.bytes = 0;
+    if (entry.inLru) {
+        lru_.erase(entry.lru);
+        entry.inLru = false;
+    }
+}
+
+void BlockCache::evict() {
+    while (used_ > budget_ && !lru_.empty()) {
+        auto it = blocks_.find(lru_.back());
+        unlink(it->second);
+        blocks_.erase(it);
+    }
+    if (used_ > budget_) {
+        LOG_DEBUG("block cache over budget with dirty blocks");
+    }
+}
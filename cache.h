@@ -0,0 +1,62 @@
+#ifndef __GPHOTOFS2_CACHE_H_
+#define __GPHOTOFS2_CACHE_H_
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// A block of file contents. data holds the valid bytes of the block, the
+// rest of the block (up to the file size) reads as zeros.
+struct Block {
+    std::vector<char> data;
+    // dirty blocks are pinned in the cache until they are written back
+    bool dirty;
+
+    Block() : dirty(false) {}
+};
+
+// Content cache shared by all files, keyed by (owner, block index).
+// Clean blocks are evicted in LRU order once the budget is exceeded.
+class BlockCache {
+public:
+    static const size_t kBlockSize = 256 * 1024;
+
+    explicit BlockCache(size_t budget);
+
+    std::shared_ptr<Block> get(const void *owner, uint64_t index);
+    // Inserts or updates a block. Call again after modifying a block, so
+    // that its size and dirty state are accounted for.
+    void put(const void *owner, uint64_t index, std::shared_ptr<Block> block);
+    // Marks all blocks of the owner as clean.
+    void clean(const void *owner);
+    // Drops the blocks of the owner from index from on, dirty or not.
+    void drop(const void *owner, uint64_t from = 0);
+
+    size_t budget() { return budget_; }
+    size_t used();
+
+private:
+    typedef std::pair<const void*, uint64_t> Key;
+    struct Entry {
+        std::shared_ptr<Block> block;
+        size_t bytes;
+        // clean blocks are in lru_, dirty ones are pinned
+        bool inLru;
+        std::list<Key>::iterator lru;
+    };
+
+    void evict();
+    void unlink(Entry& entry);
+
+    std::mutex lock_;
+    std::map<Key, Entry> blocks_;
+    // clean blocks, most recently used first
+    std::list<Key> lru_;
+    size_t budget_;
+    size_t used_;
+};
+
+#endif // __GPHOTOFS2_CACHE_H_
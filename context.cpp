@@ -1,23 +1,125 @@
 #include "context.h"
 #include "dir.h"
+#include "file.h"
+#include "utils.h"
+#include "log.h"
+#include "simulated.h"
 using namespace std;
 
-Context::Context() : root_("") {
-    context_ = gp_context_new();
-    int ret;
-    if ((ret = gp_camera_new(&camera_)) != GP_OK) {
-        return;
-    }
-    gp_abilities_list_new(&abilities_);
-    gp_abilities_list_load(abilities_, context_);
+static CameraBackend *NewBackend(const Options& options) {
+    if (!options.simulate) return new GPhotoBackend();
+    SimConfig config;
+    config.folders = options.simFolders;
+    config.files = options.simFiles;
+    config.fileSize = options.simFileSize;
+    config.latency = options.simLatency;
+    config.bandwidth = options.simBandwidth;
+    return new SimulatedBackend(config);
+}
+
+Context::Context(const Options& options) : options_(options), root_(""),
+        cache_(options.cacheSize << 20),
+        previews_(options.previewCacheSize << 20),
+        diskCache_(options.cacheDir ? options.cacheDir : "",
+                (uint64_t)options.diskCacheSize << 20),
+        statCache_(nullptr), rangedReads_(true), generation_(0),
+        io_(stats_.ioWait), uploads_(options.writebackDepth) {
+    // FUSE_ROOT_ID
+    root_.ino = 1;
+    root_.path = "/";
+    root_.index = &index_;
+    index_.add(&root_);
+    camera_.reset(new TimedBackend(NewBackend(options), &stats_));
     uid_ = getuid();
     gid_ = getgid();
-    statCache_ = nullptr;
 }
 
 Context::~Context() {
-    if (abilities_) gp_abilities_list_free(abilities_);
-    if (camera_) gp_camera_unref(camera_);
-    if (context_) gp_context_unref(context_);
+    crawler_.stop();
+    events_.stop();
+    readahead_.stop();
+    prefetch_.stop();
+    background_.stop();
+    uploads_.stop();
+    io_.stop();
+    camera_.reset();
     if (statCache_) delete statCache_;
+    for (auto& it : retiredDirs_) delete it.second;
+    for (auto& it : retiredFiles_) delete it.second;
+}
+
+uint64_t Context::enterOp() {
+    lock_guard<mutex> guard(opLock_);
+    activeOps_[generation_]++;
+    return generation_;
+}
+
+void Context::exitOp(uint64_t generation) {
+    vector<Dir*> dirs;
+    vector<File*> files;
+    {
+        lock_guard<mutex> guard(opLock_);
+        auto it = activeOps_.find(generation);
+        if (--it->second == 0) activeOps_.erase(it);
+        // Ops that started once a node was retired can't have seen it, so
+        // it can go when all that started before have exited.
+        uint64_t oldest = activeOps_.empty() ? generation_ :
+            activeOps_.begin()->first;
+        while (!retiredDirs_.empty() &&
+                retiredDirs_.front().first <= oldest) {
+            dirs.push_back(retiredDirs_.front().second);
+            retiredDirs_.pop_front();
+        }
+        while (!retiredFiles_.empty() &&
+                retiredFiles_.front().first <= oldest) {
+            files.push_back(retiredFiles_.front().second);
+            retiredFiles_.pop_front();
+        }
+    }
+    for (Dir *dir : dirs) delete dir;
+    for (File *file : files) delete file;
+}
+
+// Nodes are unlinked from the tree before they are retired.
+void Context::retire(Dir *dir) {
+    lock_guard<mutex> guard(opLock_);
+    retiredDirs_.push_back(make_pair(++generation_, dir));
+}
+
+void Context::retire(File *file) {
+    lock_guard<mutex> guard(opLock_);
+    retiredFiles_.push_back(make_pair(++generation_, file));
+}
+
+// Returns the value of a "Field: value" line in the camera summary.
+static string SummaryField(const string& summary, const string& field) {
+    size_t pos = summary.find(field + ":");
+    if (pos == string::npos) return "";
+    pos += field.size() + 1;
+    size_t end = summary.find('\n', pos);
+    string value = summary.substr(pos, end == string::npos ?
+            string::npos : end - pos);
+    size_t first = value.find_first_not_of(" \t");
+    size_t last = value.find_last_not_of(" \t\r");
+    if (first == string::npos) return "";
+    return value.substr(first, last - first + 1);
+}
+
+const string& Context::deviceId() {
+    call_once(deviceIdOnce_, [this] {
+        string summary;
+        int ret = io_.run(IO_META, [this, &summary] {
+            return camera_->summary(&summary);
+        });
+        if (ret == GP_OK) {
+            string model = SummaryField(summary, "Model");
+            string serial = SummaryField(summary, "Serial Number");
+            if (!serial.empty()) deviceId_ = model + "/" + serial;
+        }
+        if (deviceId_.empty()) {
+            LOG_WARN("camera has no serial number");
+            deviceId_ = "unknown";
+        }
+    });
+    return deviceId_;
 }
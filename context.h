@@ -4,40 +4,132 @@
 #include <string>
 #include <gphoto2/gphoto2.h>
 #include <fuse.h>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <vector>
 
+#include "backend.h"
 #include "dir.h"
+#include "cache.h"
+#include "diskcache.h"
+#include "options.h"
+#include "worker.h"
+#include "io.h"
+#include "inode.h"
+#include "index.h"
+#include "upload.h"
+#include "crawl.h"
+#include "stats.h"
 
 class Context {
 public:
-    Context();
+    Context(const Options& options);
     ~Context();
-    Camera *camera() { return camera_; }
-    GPContext *context() { return context_; }
+    // only to be used on the camera thread, see io()
+    CameraBackend& camera() { return *camera_; }
+    // the counters of the backend, from any thread
+    std::string cameraCounters() { return camera_->counters(); }
+    // counters of ops and camera calls, for /.gphotofs2/stats
+    Stats& stats() { return stats_; }
+    const Options& options() { return options_; }
     uid_t uid() { return uid_; }
     gid_t gid() { return gid_; }
     Dir& root() { return root_; }
+    PathIndex& index() { return index_; }
+    BlockCache& cache() { return cache_; }
+    // previews of the files, apart from their contents
+    BlockCache& previews() { return previews_; }
+    DiskCache& diskCache() { return diskCache_; }
+    InodeTable& inodes() { return inodes_; }
+    // Identifies the camera across mounts. Talks to the camera the first
+    // time, so it must not be called from the camera thread.
+    const std::string& deviceId();
+    // identifies the card for metadata snapshots, empty if disabled
+    const std::string& snapshotKey() { return snapshotKey_; }
+    void setSnapshotKey(const std::string& key) { snapshotKey_ = key; }
+    Worker& background() { return background_; }
+    // readahead of files being read
+    Worker& readahead() { return readahead_; }
+    // prefetch of the next files of a dir opened in order
+    Worker& prefetch() { return prefetch_; }
+    // waits for camera events, with -o events
+    Worker& events() { return events_; }
+    // only started with -o crawl
+    Crawler& crawler() { return crawler_; }
+    // only started with -o writeback
+    UploadQueue& uploads() { return uploads_; }
     struct statvfs *statCache() { return statCache_; }
-    std::mutex& lock() { return lock_; }
+    // All libgphoto2 calls on the camera go through this.
+    IoScheduler& io() { return io_; }
+    bool rangedReads() { return rangedReads_; }
+    void setRangedReads(bool rangedReads) { rangedReads_ = rangedReads; }
+    // statCache() and cacheStat() are only used on the camera thread
     void cacheStat(struct statvfs *newStat) {
         if (statCache_ == nullptr) statCache_ = new struct statvfs();
         *statCache_ = *newStat;
     }
 
+    // Ops look up nodes without holding tree locks for the whole op. Nodes
+    // unlinked from the tree are retired, and freed once the ops that were
+    // running at the time have exited. enterOp() returns the generation the
+    // op started in, to be passed to exitOp().
+    uint64_t enterOp();
+    void exitOp(uint64_t generation);
+    void retire(Dir *dir);
+    void retire(File *file);
+
 private:
-    Camera *camera_;
-    GPContext *context_;
-    CameraAbilitiesList *abilities_;
-    int debug_func_id_;
+    Stats stats_;
+    std::unique_ptr<CameraBackend> camera_;
+    Options options_;
 
     uid_t uid_;
     gid_t gid_;
 
     std::string directory_;
+    PathIndex index_;
     Dir root_;
+    BlockCache cache_;
+    BlockCache previews_;
+    DiskCache diskCache_;
+    InodeTable inodes_;
+    std::once_flag deviceIdOnce_;
+    std::string deviceId_;
+    std::string snapshotKey_;
     struct statvfs *statCache_;
-    // giant lock!
-    std::mutex lock_;
+    // cleared once the driver reports it can't do partial reads
+    std::atomic<bool> rangedReads_;
+
+    std::mutex opLock_;
+    // bumped by each retire(), nodes are stamped with their generation
+    uint64_t generation_;
+    // number of running ops by the generation they started in
+    std::map<uint64_t, int> activeOps_;
+    std::deque<std::pair<uint64_t, Dir*>> retiredDirs_;
+    std::deque<std::pair<uint64_t, File*>> retiredFiles_;
+
+    // declared last, so they are gone before anything they use
+    IoScheduler io_;
+    UploadQueue uploads_;
+    Worker background_;
+    Worker readahead_;
+    Worker prefetch_;
+    Worker events_;
+    Crawler crawler_;
+};
+
+// Marks a FUSE op or a background job step as running, see retire().
+class OpGuard {
+public:
+    OpGuard(Context *ctx) : ctx_(ctx), generation_(ctx->enterOp()) {}
+    ~OpGuard() { ctx_->exitOp(generation_); }
+
+private:
+    Context *ctx_;
+    uint64_t generation_;
 };
 
 
@@ -0,0 +1,105 @@
+#include "crawl.h"
+#include "utils.h"
+#include "log.h"
+
+#include <algorithm>
+
+using namespace std;
+
+Crawler::Crawler() : maxDepth_(0), deadline_(0), listed_(0), failed_(0),
+        startTime_(0), endTime_(0), stop_(false) {
+}
+
+Crawler::~Crawler() {
+    stop();
+}
+
+void Crawler::start(ListFunc list, int maxDepth, int timeLimit) {
+    list_ = list;
+    maxDepth_ = maxDepth;
+    startTime_ = Now();
+    deadline_ = timeLimit > 0 ? startTime_ + timeLimit : 0;
+    queue_.emplace_back("/", 0);
+    thread_ = thread(&Crawler::run, this);
+}
+
+bool Crawler::started() {
+    return thread_.joinable();
+}
+
+void Crawler::boost(const string& path) {
+    string prefix = path == "/" ? path : path + "/";
+    lock_guard<mutex> guard(lock_);
+    stable_partition(queue_.begin(), queue_.end(),
+            [&](const pair<string, int>& entry) {
+        return entry.first == path ||
+            entry.first.compare(0, prefix.size(), prefix) == 0;
+    });
+}
+
+string Crawler::progress() {
+    lock_guard<mutex> guard(lock_);
+    if (startTime_ == 0) return "";
+    bool running = endTime_ == 0;
+    string state = running ? "running" :
+        (queue_.empty() ? "done" : "stopped");
+    return "state=" + state + " listed=" + to_string(listed_) +
+        " failed=" + to_string(failed_) +
+        " queued=" + to_string(queue_.size()) +
+        " elapsed=" + to_string((running ? Now() : endTime_) - startTime_);
+}
+
+void Crawler::stop() {
+    {
+        lock_guard<mutex> guard(lock_);
+        stop_ = true;
+    }
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+// DCIM first, then the newest folders, which cameras number upwards.
+static bool CrawlOrder(const string& a, const string& b) {
+    bool aDcim = BaseName(a) == "DCIM";
+    bool bDcim = BaseName(b) == "DCIM";
+    if (aDcim != bDcim) return aDcim;
+    return a > b;
+}
+
+void Crawler::run() {
+    while (true) {
+        string path;
+        int depth;
+        {
+            lock_guard<mutex> guard(lock_);
+            if (stop_ || queue_.empty() ||
+                    (deadline_ > 0 && Now() >= deadline_)) {
+                break;
+            }
+            path = queue_.front().first;
+            depth = queue_.front().second;
+            queue_.pop_front();
+        }
+
+        vector<string> subDirs;
+        int ret = list_(path, &subDirs);
+        sort(subDirs.begin(), subDirs.end(), CrawlOrder);
+
+        lock_guard<mutex> guard(lock_);
+        if (ret != 0) {
+            failed_++;
+            continue;
+        }
+        listed_++;
+        if (maxDepth_ > 0 && depth >= maxDepth_) continue;
+        for (const string& subDir : subDirs) {
+            queue_.emplace_back(subDir, depth + 1);
+        }
+    }
+
+    lock_guard<mutex> guard(lock_);
+    endTime_ = Now();
+    LOG_DEBUG("crawl finished: " + to_string(listed_) + " dirs listed, " +
+            to_string(queue_.size()) + " left");
+}
@@ -0,0 +1,52 @@
+#ifndef __GPHOTOFS2_CRAWL_H_
+#define __GPHOTOFS2_CRAWL_H_
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Lists the tree breadth-first in the background after mount, so that paths
+// resolve without listing each ancestor on the way. DCIM and the newest
+// folders go first, and paths users ask for are moved ahead of the rest.
+class Crawler {
+public:
+    // Lists a dir and returns the paths of its subdirs.
+    typedef std::function<int(const std::string&,
+            std::vector<std::string>*)> ListFunc;
+
+    Crawler();
+    ~Crawler();
+
+    // Crawls from the root down to maxDepth levels for at most timeLimit
+    // seconds, 0 for no limit.
+    void start(ListFunc list, int maxDepth, int timeLimit);
+    bool started();
+    // Moves path and the queued dirs under it to the front of the queue.
+    void boost(const std::string& path);
+    // one line of "key=value" pairs, empty if not started
+    std::string progress();
+    void stop();
+
+private:
+    void run();
+
+    ListFunc list_;
+    int maxDepth_;
+    int deadline_;
+    std::mutex lock_;
+    // paths waiting to be listed, with their depth
+    std::deque<std::pair<std::string, int>> queue_;
+    uint64_t listed_;
+    uint64_t failed_;
+    int startTime_;
+    int endTime_;
+    bool stop_;
+    std::thread thread_;
+};
+
+#endif // __GPHOTOFS2_CRAWL_H_
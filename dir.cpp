@@ -1,46 +1,93 @@
 #include "dir.h"
 #include "file.h"
+#include "index.h"
 
 #include <mutex>
 
 using namespace std;
 
-void Dir::addFile(File *file) {
-    lock_guard<mutex> guard(mutex);
-    files[file->name] = file;
+typedef lock_guard<shared_timed_mutex> WriteGuard;
+typedef shared_lock<shared_timed_mutex> ReadGuard;
+
+bool Dir::addFile(File *file) {
+    WriteGuard guard(lock);
+    return addFileLocked(file);
+}
+
+bool Dir::addFileLocked(File *file) {
+    if (!files.insert(make_pair(file->name, file)).second) return false;
+    file->path = ChildPath(path, file->name);
+    if (index) index->add(file);
+    return true;
 }
 
 void Dir::removeFile(File *file) {
-    lock_guard<mutex> guard(mutex);
-    files.erase(file->name);
+    WriteGuard guard(lock);
+    removeFileLocked(file);
+}
+
+void Dir::removeFileLocked(File *file) {
+    auto it = files.find(file->name);
+    if (it != files.end() && it->second == file) {
+        files.erase(it);
+        if (index) index->remove(file);
+    }
+}
+
+bool Dir::addDir(Dir *dir) {
+    WriteGuard guard(lock);
+    return addDirLocked(dir);
 }
 
-void Dir::addDir(Dir *dir) {
-    lock_guard<mutex> guard(mutex);
-    dirs[dir->name] = dir;
+bool Dir::addDirLocked(Dir *dir) {
+    if (!dirs.insert(make_pair(dir->name, dir)).second) return false;
+    dir->path = ChildPath(path, dir->name);
+    dir->index = index;
+    if (index) index->add(dir);
+    return true;
 }
 
 void Dir::removeDir(Dir *dir) {
-    lock_guard<mutex> guard(mutex);
-    dirs.erase(dir->name);
+    WriteGuard guard(lock);
+    removeDirLocked(dir);
+}
+
+void Dir::removeDirLocked(Dir *dir) {
+    auto it = dirs.find(dir->name);
+    if (it != dirs.end() && it->second == dir) {
+        dirs.erase(it);
+        dir->unindex();
+    }
+}
+
+void Dir::unindex() {
+    if (index == nullptr) return;
+    ReadGuard guard(lock);
+    index->remove(this);
+    for (auto& it : files) {
+        index->remove(it.second);
+    }
+    for (auto& it : dirs) {
+        it.second->unindex();
+    }
 }
 
 File* Dir::getFile(const std::string& name) {
-    lock_guard<mutex> guard(mutex);
+    ReadGuard guard(lock);
     auto it = files.find(name);
     if (it == files.end()) return nullptr;
     return it->second;
 }
 
 Dir* Dir::getDir(const std::string& name) {
-    lock_guard<mutex> guard(mutex);
+    ReadGuard guard(lock);
     auto it = dirs.find(name);
     if (it == dirs.end()) return nullptr;
     return it->second;
 }
 
 bool Dir::empty() {
-    lock_guard<mutex> guard(mutex);
+    ReadGuard guard(lock);
     return files.empty() && dirs.empty();
 }
 
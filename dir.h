@@ -1,33 +1,73 @@
 #ifndef __GPHOTOFS2_DIR_H_
 #define __GPHOTOFS2_DIR_H_
 
+#include <atomic>
 #include <string>
 #include <map>
 
 #include <mutex>
+#include <shared_mutex>
+
+#include "utils.h"
 
 class File;
+class PathIndex;
 
+/*
+ * Lock order: parent dir, child dir, file, camera.
+ * The maps are protected by lock, iterate them with it held shared.
+ */
 struct Dir {
     std::string name;
+    // full path, set when the dir is added to its parent
+    std::string path;
+    uint64_t ino;
+    // the index the dir is in, inherited from the parent
+    PathIndex *index;
 
-    bool listed;
+    std::atomic<bool> listed;
+    // when the listing was last taken, and whether a refresh of it is
+    // pending, for -o dir_ttl
+    std::atomic<int> listedAt;
+    std::atomic<bool> refreshing;
     std::map<std::string, File*> files;
     std::map<std::string, Dir*> dirs;
-    std::mutex lock;
+    std::shared_timed_mutex lock;
+    // serializes listing, so that a dir is only listed once
+    std::mutex listLock;
+    // the file opened last, and the last one scheduled for prefetch, to
+    // follow opens in listing order; protected by openLock
+    std::string lastOpened;
+    std::string prefetchedTo;
+    std::mutex openLock;
 
-    Dir(const std::string& name) : name(name), listed(false) {}
+    Dir(const std::string& name) : name(name), ino(NewInode()),
+        index(nullptr), listed(false), listedAt(0), refreshing(false) {}
     ~Dir();
 
-    void addFile(File *file);
+    // Adding and removing children keeps the index up to date. The Locked
+    // variants expect lock to be held exclusively.
+
+    // Returns false if there is already a file with the same name.
+    bool addFile(File *file);
+    bool addFileLocked(File *file);
     void removeFile(File *file);
+    void removeFileLocked(File *file);
     File* getFile(const std::string& name);
 
-    void addDir(Dir *dir);
+    // Returns false if there is already a dir with the same name. A dir is
+    // added empty, its children are indexed as they are added.
+    bool addDir(Dir *dir);
+    bool addDirLocked(Dir *dir);
+    // Also drops everything under dir from the index.
     void removeDir(Dir *dir);
+    void removeDirLocked(Dir *dir);
     Dir* getDir(const std::string& name);
 
     bool empty();
+
+private:
+    void unindex();
 };
 
 #endif // __GPHOTOFS2_DIR_H_
@@ -0,0 +1,287 @@
+#include "diskcache.h"
+#include "cache.h"
+#include "utils.h"
+#include "log.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <set>
+#include <sstream>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// at most this many objects are filled at the same time
+static const size_t kMaxPartials = 16;
+// seconds between writes of a changed index
+static const int kFlushInterval = 10;
+
+DiskCache::DiskCache(const string& dir, uint64_t capacity)
+    : dir_(dir), capacity_(capacity), used_(0), dirty_(false),
+      stop_(false) {
+    if (dir_.empty()) return;
+
+    mkdir(dir_.c_str(), 0700);
+    mkdir((dir_ + "/objects").c_str(), 0700);
+    loadIndex();
+
+    // Remove leftovers of objects being filled, and objects that did not
+    // make it into the index before a crash.
+    DIR *objects = opendir((dir_ + "/objects").c_str());
+    if (objects == nullptr) {
+        LOG_ERROR("can't open disk cache dir " + dir_);
+        dir_.clear();
+        return;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(objects)) != nullptr) {
+        string name = ent->d_name;
+        if (name == "." || name == "..") continue;
+        if (entries_.find(name) == entries_.end()) {
+            unlink(objectPath(name).c_str());
+        }
+    }
+    closedir(objects);
+    evict();
+    flusher_ = thread(&DiskCache::flushIndex, this);
+}
+
+DiskCache::~DiskCache() {
+    if (!enabled()) return;
+    {
+        lock_guard<mutex> guard(lock_);
+        stop_ = true;
+        flushCond_.notify_one();
+    }
+    flusher_.join();
+    while (!partials_.empty()) {
+        dropPartial(partials_.begin()->first);
+    }
+    // persist access times
+    saveIndex();
+}
+
+string DiskCache::objectPath(const string& hash) {
+    return dir_ + "/objects/" + hash;
+}
+
+int DiskCache::open(const string& key) {
+    if (!enabled()) return -1;
+    lock_guard<mutex> guard(lock_);
+    string h = HashString(key);
+    auto it = entries_.find(h);
+    if (it == entries_.end() || it->second.key != key) {
+        return -1;
+    }
+    int fd = ::open(objectPath(h).c_str(), O_RDONLY);
+    if (fd < 0) {
+        LOG_WARN("disk cache object missing: " + h);
+        removeEntry(h);
+        return -1;
+    }
+    it->second.atime = Now();
+    return fd;
+}
+
+void DiskCache::store(const string& key, off_t size, off_t offset,
+        const char *data, size_t len) {
+    if (!enabled() || size <= 0 || (uint64_t)size > capacity_) return;
+    lock_guard<mutex> guard(lock_);
+    string h = HashString(key);
+    auto found = entries_.find(h);
+    if (found != entries_.end()) {
+        if (found->second.key == key) return;
+        // hash collision, the newer object wins
+        removeEntry(h);
+    }
+
+    auto it = partials_.find(h);
+    if (it == partials_.end()) {
+        if (partials_.size() >= kMaxPartials) {
+            string oldest;
+            int oldestTime = 0;
+            for (auto& p : partials_) {
+                if (oldest.empty() || p.second.ctime < oldestTime) {
+                    oldest = p.first;
+                    oldestTime = p.second.ctime;
+                }
+            }
+            dropPartial(oldest);
+        }
+        string path = objectPath(h) + ".part";
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) {
+            LOG_WARN("can't create disk cache object " + path);
+            return;
+        }
+        Partial partial;
+        partial.fd = fd;
+        partial.size = size;
+        partial.stored = 0;
+        partial.blocks.resize(
+                (size + BlockCache::kBlockSize - 1) / BlockCache::kBlockSize);
+        partial.ctime = Now();
+        it = partials_.insert(make_pair(h, partial)).first;
+    }
+
+    Partial& partial = it->second;
+    if (partial.size != size) {
+        dropPartial(h);
+        return;
+    }
+    if (pwrite(partial.fd, data, len, offset) != (ssize_t)len) {
+        LOG_WARN("disk cache write failed");
+        dropPartial(h);
+        return;
+    }
+
+    // only count blocks covered completely
+    const off_t blockSize = BlockCache::kBlockSize;
+    off_t end = offset + len;
+    for (off_t index = (offset + blockSize - 1) / blockSize;
+            index < (off_t)partial.blocks.size(); index++) {
+        off_t blockEnd = min((index + 1) * blockSize, size);
+        if (blockEnd > end) break;
+        if (!partial.blocks[index]) {
+            partial.blocks[index] = true;
+            partial.stored += blockEnd - index * blockSize;
+        }
+    }
+    if (partial.stored == partial.size) {
+        commit(h, key, partial);
+    }
+}
+
+void DiskCache::commit(const string& hash, const string& key,
+        Partial& partial) {
+    string path = objectPath(hash);
+    if (fsync(partial.fd) != 0 ||
+            rename((path + ".part").c_str(), path.c_str()) != 0) {
+        LOG_WARN("can't commit disk cache object " + path);
+        dropPartial(hash);
+        return;
+    }
+    close(partial.fd);
+    Entry entry;
+    entry.key = key;
+    entry.size = partial.size;
+    entry.atime = Now();
+    partials_.erase(hash);
+    entries_[hash] = entry;
+    used_ += entry.size;
+    dirty_ = true;
+    LOG_DEBUG("disk cache stored " + key);
+
+    evict();
+}
+
+void DiskCache::remove(const string& key) {
+    if (!enabled()) return;
+    lock_guard<mutex> guard(lock_);
+    string h = HashString(key);
+    if (partials_.find(h) != partials_.end()) {
+        dropPartial(h);
+    }
+    auto it = entries_.find(h);
+    if (it != entries_.end() && it->second.key == key) {
+        removeEntry(h);
+    }
+}
+
+void DiskCache::dropPartial(const string& hash) {
+    auto it = partials_.find(hash);
+    close(it->second.fd);
+    unlink((objectPath(hash) + ".part").c_str());
+    partials_.erase(it);
+}
+
+void DiskCache::removeEntry(const string& hash) {
+    auto it = entries_.find(hash);
+    used_ -= it->second.size;
+    entries_.erase(it);
+    dirty_ = true;
+    // open fds stay valid
+    unlink(objectPath(hash).c_str());
+}
+
+void DiskCache::evict() {
+    while (used_ > capacity_ && !entries_.empty()) {
+        auto oldest = entries_.begin();
+        for (auto it = entries_.begin(); it != entries_.end(); it++) {
+            if (it->second.atime < oldest->second.atime) {
+                oldest = it;
+            }
+        }
+        LOG_DEBUG("disk cache evict " + oldest->second.key);
+        removeEntry(oldest->first);
+    }
+}
+
+/*
+ * Index format, one object per line:
+ *   <hash> <size> <atime> <key>
+ */
+void DiskCache::loadIndex() {
+    ifstream index(dir_ + "/index");
+    string line;
+    while (getline(index, line)) {
+        istringstream in(line);
+        string h;
+        Entry entry;
+        if (!(in >> h >> entry.size >> entry.atime)) continue;
+        in.get();
+        getline(in, entry.key);
+        struct stat st;
+        if (stat(objectPath(h).c_str(), &st) != 0 ||
+                (uint64_t)st.st_size != entry.size) {
+            continue;
+        }
+        entries_[h] = entry;
+        used_ += entry.size;
+    }
+}
+
+void DiskCache::saveIndex() {
+    map<string, Entry> entries;
+    {
+        lock_guard<mutex> guard(lock_);
+        entries = entries_;
+        dirty_ = false;
+    }
+    string path = dir_ + "/index";
+    string tmpPath = path + ".tmp";
+    FILE *index = fopen(tmpPath.c_str(), "w");
+    if (index == nullptr) {
+        LOG_WARN("can't write disk cache index");
+        return;
+    }
+    for (auto& it : entries) {
+        fprintf(index, "%s %llu %d %s\n", it.first.c_str(),
+                (unsigned long long)it.second.size, it.second.atime,
+                it.second.key.c_str());
+    }
+    fflush(index);
+    fsync(fileno(index));
+    fclose(index);
+    if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+        LOG_WARN("can't replace disk cache index");
+    }
+}
+
+// Runs on flusher_, so that storing an object doesn't wait for the index.
+void DiskCache::flushIndex() {
+    unique_lock<mutex> guard(lock_);
+    while (!stop_) {
+        flushCond_.wait_for(guard, chrono::seconds(kFlushInterval),
+                [this] { return stop_; });
+        if (stop_ || !dirty_) continue;
+        guard.unlock();
+        saveIndex();
+        guard.lock();
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef __GPHOTOFS2_DISKCACHE_H_
+#define __GPHOTOFS2_DISKCACHE_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/types.h>
+
+// Persistent cache of whole camera objects in a local directory.
+// Objects are filled block by block and only become visible once all of
+// them has been stored. The index is written by a background thread every
+// few seconds while it has changes, and at shutdown. It is replaced
+// atomically with rename(), and files not listed in it are removed at
+// startup, so a crash loses at most the objects stored since the last
+// write.
+class DiskCache {
+public:
+    // An empty dir disables the cache.
+    DiskCache(const std::string& dir, uint64_t capacity);
+    ~DiskCache();
+
+    bool enabled() { return !dir_.empty(); }
+    const std::string& dir() { return dir_; }
+    // Returns a read-only fd of the cached object, or -1 on a miss.
+    int open(const std::string& key);
+    // Stores [offset, offset + len) of an object of the given size.
+    void store(const std::string& key, off_t size, off_t offset,
+            const char *data, size_t len);
+    void remove(const std::string& key);
+
+private:
+    struct Entry {
+        std::string key;
+        uint64_t size;
+        int atime;
+    };
+    // an object being filled
+    struct Partial {
+        int fd;
+        off_t size;
+        off_t stored;
+        std::vector<bool> blocks;
+        int ctime;
+    };
+
+    std::string objectPath(const std::string& hash);
+    void loadIndex();
+    // Writes a copy of the index taken with lock_, without holding it.
+    void saveIndex();
+    void flushIndex();
+    void commit(const std::string& hash, const std::string& key,
+            Partial& partial);
+    void dropPartial(const std::string& hash);
+    void removeEntry(const std::string& hash);
+    void evict();
+
+    std::string dir_;
+    uint64_t capacity_;
+    uint64_t used_;
+    std::mutex lock_;
+    std::map<std::string, Entry> entries_;
+    std::map<std::string, Partial> partials_;
+    // the index has changed since it was last written
+    bool dirty_;
+    bool stop_;
+    std::condition_variable flushCond_;
+    std::thread flusher_;
+};
+
+#endif // __GPHOTOFS2_DISKCACHE_H_
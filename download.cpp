@@ -0,0 +1,67 @@
+#include "download.h"
+
+#include <algorithm>
+#include <cerrno>
+
+#include <unistd.h>
+
+using namespace std;
+
+Download::Download(int fd) : fd_(fd), received_(0), done_(false),
+        result_(0) {
+}
+
+Download::~Download() {
+    if (fd_ >= 0) close(fd_);
+}
+
+int Download::append(const char *data, size_t len) {
+    // Only the transfer writes, readers don't look past received_.
+    if (pwrite(fd_, data, len, received_) != (ssize_t)len) {
+        return -EIO;
+    }
+    lock_guard<mutex> guard(lock_);
+    received_ += len;
+    cond_.notify_all();
+    return 0;
+}
+
+void Download::finish(int result) {
+    lock_guard<mutex> guard(lock_);
+    done_ = true;
+    result_ = result;
+    cond_.notify_all();
+}
+
+int Download::read(char *buf, size_t size, off_t offset) {
+    off_t end;
+    {
+        unique_lock<mutex> guard(lock_);
+        cond_.wait(guard, [this, size, offset] {
+            return done_ || received_ >= offset + (off_t)size;
+        });
+        if (result_ != 0) {
+            return result_;
+        }
+        end = received_;
+    }
+    if (offset >= end) {
+        return 0;
+    }
+    size = min(size, (size_t)(end - offset));
+    ssize_t ret = pread(fd_, buf, size, offset);
+    if (ret < 0) {
+        return -errno;
+    }
+    return ret;
+}
+
+bool Download::failed() {
+    lock_guard<mutex> guard(lock_);
+    return done_ && result_ != 0;
+}
+
+off_t Download::received() {
+    lock_guard<mutex> guard(lock_);
+    return received_;
+}
@@ -0,0 +1,42 @@
+#ifndef __GPHOTOFS2_DOWNLOAD_H_
+#define __GPHOTOFS2_DOWNLOAD_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+#include <sys/types.h>
+
+// A whole-file download, for drivers that can't do ranged reads. It is
+// shared by all readers of the file, who get their bytes as soon as they
+// have arrived instead of waiting for the whole object. The contents go to
+// a temp file, so that large objects don't take up memory.
+class Download {
+public:
+    // Takes over fd, an unlinked temp file.
+    explicit Download(int fd);
+    ~Download();
+
+    // Called by the transfer, data arrives in order. Returns 0 or a
+    // negative errno.
+    int append(const char *data, size_t len);
+    // result is 0 or a negative errno
+    void finish(int result);
+
+    // Waits for [offset, offset + size) to arrive, or the transfer to end.
+    // Returns the number of bytes copied, or the error of the transfer.
+    int read(char *buf, size_t size, off_t offset);
+    bool failed();
+    // bytes arrived so far
+    off_t received();
+
+private:
+    std::mutex lock_;
+    std::condition_variable cond_;
+    int fd_;
+    off_t received_;
+    bool done_;
+    int result_;
+};
+
+#endif // __GPHOTOFS2_DOWNLOAD_H_
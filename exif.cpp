@@ -0,0 +1,173 @@
+#include "exif.h"
+
+#include <cstdint>
+#include <cstring>
+
+using namespace std;
+
+void InfoXattrs(const CameraFileInfo& info, Xattrs *xattrs) {
+    const CameraFileInfoFile& file = info.file;
+    if ((file.fields & GP_FILE_INFO_TYPE) && file.type[0] != '\0') {
+        (*xattrs)["user.camera.type"] =
+            string(file.type, strnlen(file.type, sizeof(file.type)));
+    }
+    if ((file.fields & GP_FILE_INFO_WIDTH) && file.width > 0) {
+        (*xattrs)["user.camera.width"] = to_string(file.width);
+    }
+    if ((file.fields & GP_FILE_INFO_HEIGHT) && file.height > 0) {
+        (*xattrs)["user.camera.height"] = to_string(file.height);
+    }
+    if (file.fields & GP_FILE_INFO_STATUS) {
+        (*xattrs)["user.camera.downloaded"] =
+            file.status == GP_FILE_STATUS_DOWNLOADED ? "1" : "0";
+    }
+    if (file.fields & GP_FILE_INFO_PERMISSIONS) {
+        (*xattrs)["user.camera.deletable"] =
+            (file.permissions & GP_FILE_PERM_DELETE) ? "1" : "0";
+    }
+}
+
+/*
+ * Reads the IFDs of a TIFF structure, with bounds checks on every access.
+ */
+class TiffReader {
+public:
+    TiffReader(const unsigned char *data, size_t size)
+        : data_(data), size_(size), bigEndian_(data[0] == 'M') {}
+
+    bool has(size_t offset, size_t len) const {
+        return offset <= size_ && len <= size_ - offset;
+    }
+
+    uint16_t u16(size_t offset) const {
+        if (!has(offset, 2)) return 0;
+        const unsigned char *p = data_ + offset;
+        return bigEndian_ ? (p[0] << 8 | p[1]) : (p[1] << 8 | p[0]);
+    }
+
+    uint32_t u32(size_t offset) const {
+        if (!has(offset, 4)) return 0;
+        const unsigned char *p = data_ + offset;
+        return bigEndian_ ?
+            ((uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]) :
+            ((uint32_t)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0]);
+    }
+
+    // Value of an entry as text. Returns false for types not handled.
+    bool value(size_t entry, string *text) const {
+        uint16_t type = u16(entry + 2);
+        uint32_t count = u32(entry + 4);
+        switch (type) {
+        case 2: {   // ASCII
+            size_t offset = count <= 4 ? entry + 8 : u32(entry + 8);
+            if (count == 0 || !has(offset, count)) return false;
+            const char *s = (const char *)data_ + offset;
+            *text = string(s, strnlen(s, count));
+            return true;
+        }
+        case 3:     // SHORT
+            *text = to_string(u16(entry + 8));
+            return true;
+        case 4:     // LONG
+            *text = to_string(u32(entry + 8));
+            return true;
+        case 5: {   // RATIONAL
+            size_t offset = u32(entry + 8);
+            if (!has(offset, 8)) return false;
+            uint32_t num = u32(offset), den = u32(offset + 4);
+            if (den == 0) return false;
+            *text = den == 1 ? to_string(num) :
+                to_string(num) + "/" + to_string(den);
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
+
+private:
+    const unsigned char *data_;
+    size_t size_;
+    bool bigEndian_;
+};
+
+struct ExifTag {
+    uint16_t tag;
+    const char *name;
+};
+
+static const ExifTag kImageTags[] = {
+    {0x010f, "user.exif.make"},
+    {0x0110, "user.exif.model"},
+    {0x0112, "user.exif.orientation"},
+    {0x0132, "user.exif.datetime"},
+};
+
+static const ExifTag kExifTags[] = {
+    {0x829a, "user.exif.exposure_time"},
+    {0x829d, "user.exif.fnumber"},
+    {0x8827, "user.exif.iso"},
+    {0x9003, "user.exif.datetime_original"},
+    {0x920a, "user.exif.focal_length"},
+    {0xa002, "user.exif.width"},
+    {0xa003, "user.exif.height"},
+};
+
+static const uint16_t kExifIfdTag = 0x8769;
+
+template <size_t N>
+static uint32_t ReadIfd(const TiffReader& tiff, uint32_t ifd,
+        const ExifTag (&tags)[N], Xattrs *xattrs) {
+    uint32_t exifIfd = 0;
+    uint16_t count = tiff.u16(ifd);
+    for (uint16_t i = 0; i < count; i++) {
+        size_t entry = ifd + 2 + i * 12;
+        if (!tiff.has(entry, 12)) break;
+        uint16_t tag = tiff.u16(entry);
+        if (tag == kExifIfdTag) {
+            exifIfd = tiff.u32(entry + 8);
+            continue;
+        }
+        for (const ExifTag& known : tags) {
+            string text;
+            if (known.tag == tag && tiff.value(entry, &text)) {
+                (*xattrs)[known.name] = text;
+            }
+        }
+    }
+    return exifIfd;
+}
+
+bool ExifXattrs(const unsigned char *data, size_t size, Xattrs *xattrs) {
+    // Find the APP1 segment of a JPEG file.
+    if (size >= 4 && data[0] == 0xff && data[1] == 0xd8) {
+        size_t pos = 2;
+        while (true) {
+            if (pos + 4 > size || data[pos] != 0xff) return false;
+            // image data starts, no APP1 before it
+            if (data[pos + 1] == 0xda) return false;
+            size_t len = data[pos + 2] << 8 | data[pos + 3];
+            if (data[pos + 1] == 0xe1) {
+                data += pos + 4;
+                size = min(size - pos - 4, len < 2 ? 0 : len - 2);
+                break;
+            }
+            pos += 2 + len;
+        }
+    }
+    if (size >= 6 && memcmp(data, "Exif\0\0", 6) == 0) {
+        data += 6;
+        size -= 6;
+    }
+    if (size < 8 || (memcmp(data, "II*\0", 4) != 0 &&
+                memcmp(data, "MM\0*", 4) != 0)) {
+        return false;
+    }
+
+    TiffReader tiff(data, size);
+    uint32_t exifIfd = ReadIfd(tiff, tiff.u32(4), kImageTags, xattrs);
+    if (exifIfd != 0) {
+        ReadIfd(tiff, exifIfd, kExifTags, xattrs);
+    }
+    return true;
+}
@@ -0,0 +1,19 @@
+#ifndef __GPHOTOFS2_EXIF_H_
+#define __GPHOTOFS2_EXIF_H_
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <gphoto2/gphoto2.h>
+
+// Extended attributes of a file, by name.
+typedef std::map<std::string, std::string> Xattrs;
+
+// Adds the fields of the file info the camera knows, as user.camera.*.
+void InfoXattrs(const CameraFileInfo& info, Xattrs *xattrs);
+// Adds the common tags of EXIF data, as user.exif.*. The data may be a
+// bare TIFF structure, an APP1 payload or the start of a JPEG file. Returns
+// false if no EXIF data is found.
+bool ExifXattrs(const unsigned char *data, size_t size, Xattrs *xattrs);
+
+#endif // __GPHOTOFS2_EXIF_H_
@@ -3,47 +3,134 @@
 
 #include <string>
 #include <gphoto2/gphoto2.h>
+#include <condition_variable>
+#include <memory>
 #include <mutex>
+#include <set>
+#include <unistd.h>
 
 #include "utils.h"
+#include "log.h"
+#include "download.h"
+#include "exif.h"
 
+// Fields are protected by lock, except name, path and ino which don't change
+// once the file is in the tree. size, mtime and infoPending are also
+// protected by attrLock, so that they can be read without waiting for I/O
+// done under lock. Update them with both held. xattrs are protected by
+// attrLock alone.
 struct File {
     std::string name;
-    CameraFile *camFile;
-    char *buf;
+    // full path, set when the file is added to its dir
+    std::string path;
+    uint64_t ino;
+    // whole file download, only used if the driver can't do ranged reads
+    std::shared_ptr<Download> download;
+    // blocks being fetched with lock released, wait on fetched for them
+    std::set<uint64_t> fetching;
+    std::condition_variable fetched;
+    // bumped when cached blocks are dropped, so that fetches that were
+    // running don't add stale contents
+    uint64_t epoch;
+    // object in the disk cache, while the file is open
+    int cacheFd;
+    // unlinked temp file with all of the contents, used instead of the
+    // content cache once a file being written gets large
+    int spillFd;
     off_t size;
+    // size of the object on the camera, contents past it are not fetched
+    off_t camSize;
 //    bool writeable;
     int mtime;
     int ref;
     bool changed;
+    // listed by name only, size and mtime are not known yet
+    bool infoPending;
+    // deleted from the camera, about to be dropped from the tree
+    bool unlinked;
+    // where the last read ended, and the block up to which the contents
+    // after it are being read ahead
+    off_t nextRead;
+    uint64_t readahead;
+    // extended attributes, from the file info when it comes with the
+    // listing, or fetched when one is asked for; xattrsLoaded once the EXIF
+    // tags have been added, or the camera has none
+    Xattrs xattrs;
+    bool xattrsLoaded;
+    // size of the preview once it has been fetched, -1 before; if the
+    // camera has none, previewError is kept instead so it isn't asked again
+    off_t previewSize;
+    int previewError;
     std::mutex lock;
+    std::mutex attrLock;
 
     File(const std::string& name, const CameraFileInfo& info) {
         this->name = name;
+        ino = NewInode();
         mtime = info.file.mtime;
         size = info.file.size;
-        buf = NULL;
+        camSize = size;
         ref = 0;
         changed = false;
-        camFile = nullptr;
+        infoPending = false;
+        unlinked = false;
+        epoch = 0;
+        cacheFd = -1;
+        spillFd = -1;
+        InfoXattrs(info, &xattrs);
+        xattrsLoaded = false;
+        nextRead = 0;
+        readahead = 0;
+        previewSize = -1;
+        previewError = 0;
+    }
+
+    File(const std::string& name, off_t size, int mtime) {
+        this->name = name;
+        ino = NewInode();
+        this->mtime = mtime;
+        this->size = size;
+        camSize = size;
+        ref = 0;
+        changed = false;
+        infoPending = false;
+        unlinked = false;
+        epoch = 0;
+        cacheFd = -1;
+        spillFd = -1;
+        xattrsLoaded = false;
+        nextRead = 0;
+        readahead = 0;
+        previewSize = -1;
+        previewError = 0;
     }
 
     File(const std::string& name) {
         this->name = name;
+        ino = NewInode();
         mtime = Now();
         size = 0;
-        buf = NULL;
+        camSize = 0;
         ref = 0;
         changed = false;
-        camFile = nullptr;
+        infoPending = false;
+        unlinked = false;
+        epoch = 0;
+        cacheFd = -1;
+        spillFd = -1;
+        xattrsLoaded = false;
+        nextRead = 0;
+        readahead = 0;
+        previewSize = -1;
+        previewError = 0;
     }
 
     ~File() {
         if (ref > 0) {
-            Error("deleting active file");
+            LOG_ERROR("deleting active file");
         }
-        if (buf) delete[] buf;
-        if (camFile) gp_file_unref(camFile);
+        if (cacheFd >= 0) close(cacheFd);
+        if (spillFd >= 0) close(spillFd);
     }
 };
 
@@ -1,48 +1,216 @@
+#include <atomic>
 #include <string>
 #include <mutex>
+#include <shared_mutex>
 #include <vector>
 #include <memory>
 #include <map>
+#include <set>
+#include <deque>
 #include <cstdlib>
+#include <cstddef>
+#include <cstring>
 
 #include <fuse.h>
+#include <fuse_opt.h>
+#include <fuse_lowlevel.h>
 #include <gphoto2/gphoto2.h>
-#include <libgen.h>
 #include <locale.h>
 
 #include "dir.h"
 #include "file.h"
 #include "utils.h"
+#include "log.h"
 #include "context.h"
+#include "options.h"
+#include "snapshot.h"
+#include "preview.h"
+#include "trace.h"
 
 using namespace std;
 
-struct Options {
-    string port;
-    string model;
-    string usbid;
-    int speed;
-};
+typedef shared_lock<shared_timed_mutex> ReadGuard;
+typedef lock_guard<shared_timed_mutex> WriteGuard;
 
 struct FileDesc {
     bool writeable;
     File *file;
+    // opened under /.previews, reads the preview of the file
+    bool preview;
+    // opened under /.gphotofs2, file is null and reads give report
+    bool stats;
+    string report;
 };
 
-static int ListDir(const char *path, Dir *dir, Context *ctx);
+static int ListDir(Dir *dir, Context *ctx, IoPriority priority = IO_META);
+static int FetchInfo(const string& path, File *file, Context *ctx,
+        IoPriority priority = IO_META);
+static void FetchPendingInfo(const string& path, Context *ctx);
+static void RevalidateStale(Dir *dir, Context *ctx);
+static int UploadFile(const string& path, File *file, IoPriority priority,
+        Context *ctx);
+static int TruncateFile(const string& path, File *file, off_t size,
+        Context *ctx);
+static string CacheKey(const string& path, File *file, Context *ctx);
+static void PrefetchBlocks(const string& path, uint64_t from, uint64_t to,
+        IoPriority priority, Worker& worker, Context *ctx);
 Dir* FindDir(const string& path, Context *ctx);
 File* FindFile(const string& path, Context *ctx);
 
-/* 
+// The mounted filesystem. Kept here instead of being taken from
+// fuse_get_context(), which the low-level API doesn't have.
+static Context *mounted = nullptr;
+
+static Context *CurrentContext() {
+    return mounted;
+}
+
+// The low-level channel, to tell the kernel about changes made on the
+// camera. The high-level API can't, and relies on the timeouts.
+static struct fuse_chan *channel = nullptr;
+
+/*
+ * Makes the kernel forget a name in a dir, and in its preview mirror. Don't
+ * call with tree locks held, the kernel may be waiting on them to finish a
+ * lookup before it can drop the name.
+ */
+static void InvalidateEntry(uint64_t parent, const string& name,
+        Context *ctx) {
+    if (channel == nullptr) return;
+    fuse_lowlevel_notify_inval_entry(channel, parent, name.c_str(),
+            name.size());
+    if (ctx->options().previews) {
+        fuse_lowlevel_notify_inval_entry(channel, PreviewIno(parent),
+                name.c_str(), name.size());
+    }
+}
+
+// Makes the kernel drop the cached attributes and contents of a node.
+static void InvalidateInode(uint64_t ino) {
+    if (channel == nullptr) return;
+    fuse_lowlevel_notify_inval_inode(channel, ino, 0, 0);
+}
+
+// Times an op into the stats, and traces it.
+class OpTimer {
+public:
+    OpTimer(Context *ctx, StatOp op, const char *path, uint64_t bytes = 0)
+        : timer_(ctx->stats().op(op)),
+          trace_("op", StatOpName(op), path, nullptr, bytes) {}
+
+private:
+    StatTimer timer_;
+    TraceScope trace_;
+};
+
+/*
+ * Statistics
+ *
+ * Counters are read from files in a hidden dir, which are answered
+ * without touching the camera. Writing to them resets the counters.
+ */
+
+static const char kStatsRoot[] = "/.gphotofs2";
+// apart from node inodes, and from previews which have bit 62 set
+static const uint64_t kStatsIno = 1ULL << 61;
+
+enum StatsNode {
+    STATS_NONE = 0,
+    STATS_DIR,
+    STATS_TEXT,
+    STATS_JSON,
+    // an unknown name in the stats dir
+    STATS_MISSING,
+};
+
+static const char *kStatsFiles[] = { "stats", "stats.json" };
+
+static StatsNode StatsPath(const char *path) {
+    size_t len = sizeof(kStatsRoot) - 1;
+    if (strncmp(path, kStatsRoot, len) != 0) return STATS_NONE;
+    if (path[len] == '\0') return STATS_DIR;
+    if (path[len] != '/') return STATS_NONE;
+    const char *name = path + len + 1;
+    if (strcmp(name, kStatsFiles[0]) == 0) return STATS_TEXT;
+    if (strcmp(name, kStatsFiles[1]) == 0) return STATS_JSON;
+    return STATS_MISSING;
+}
+
+static string StatsReport(bool json, Context *ctx) {
+    StatValues values;
+    ctx->stats().values(&values);
+    AddStat(&values, "cache.used_bytes", ctx->cache().used());
+    AddStat(&values, "cache.budget_bytes", ctx->cache().budget());
+    AddStat(&values, "previews.used_bytes", ctx->previews().used());
+    AddStat(&values, "queue.io_meta", ctx->io().queued(IO_META));
+    AddStat(&values, "queue.io_read", ctx->io().queued(IO_READ));
+    AddStat(&values, "queue.io_background", ctx->io().queued(IO_BACKGROUND));
+    AddStat(&values, "queue.uploads", ctx->uploads().pendingFiles());
+    AddStat(&values, "queue.upload_bytes", ctx->uploads().pendingBytes());
+    string progress = ctx->crawler().progress();
+    if (!progress.empty()) AddStat(&values, "crawl", progress);
+    string counters = ctx->cameraCounters();
+    if (!counters.empty()) AddStat(&values, "camera.counters", counters);
+    return FormatStats(values, json);
+}
+
+static int GetattrStats(StatsNode node, struct stat *st, Context *ctx) {
+    if (node == STATS_MISSING) return -ENOENT;
+    st->st_ino = kStatsIno + node;
+    // the size is not known before the report is taken, see OpenStats()
+    st->st_mode = node == STATS_DIR ? S_IFDIR | 0755 : S_IFREG | 0644;
+    st->st_nlink = node == STATS_DIR ? 2 : 1;
+    st->st_mtime = time(nullptr);
+    st->st_uid = ctx->uid();
+    st->st_gid = ctx->gid();
+    return 0;
+}
+
+/*
+ * The report is taken once at open, and read directly, so that its size
+ * doesn't need to be known beforehand. Opening it for writing with
+ * O_TRUNC resets the counters, as writing does.
+ */
+static int OpenStats(StatsNode node, struct fuse_file_info *fileInfo,
+        Context *ctx) {
+    if (node == STATS_MISSING) return -ENOENT;
+    if (node == STATS_DIR) return -EISDIR;
+    int mode = fileInfo->flags & 3;
+    if ((fileInfo->flags & O_TRUNC) && mode != O_RDONLY) {
+        ctx->stats().reset();
+    }
+    FileDesc *fd = new FileDesc();
+    fd->writeable = mode != O_RDONLY;
+    fd->stats = true;
+    if (mode != O_WRONLY) fd->report = StatsReport(node == STATS_JSON, ctx);
+    fileInfo->fh = (uint64_t)fd;
+    fileInfo->direct_io = 1;
+    return 0;
+}
+
+/*
  * Operations
  */
 
+static int GetattrPreview(const string& path, struct stat *st,
+        Context *ctx);
+
 static int Getattr(const char *path, struct stat *st) {
-    Context *ctx = (Context*)fuse_get_context()->private_data;
-    lock_guard<mutex> guard(ctx->lock());
+    Context *ctx = CurrentContext();
+    OpTimer timer(ctx, STAT_GETATTR, path);
+    OpGuard op(ctx);
+
+    StatsNode stats = StatsPath(path);
+    if (stats != STATS_NONE) return GetattrStats(stats, st, ctx);
+
+    string realPath;
+    if (PreviewPath(path, &realPath, ctx)) {
+        return GetattrPreview(realPath, st, ctx);
+    }
 
     Dir *dir = FindDir(path, ctx);
     if (dir != nullptr) {
+        st->st_ino = dir->ino;
         st->st_mode = S_IFDIR | 0755;
         st->st_nlink = 2;
         st->st_uid = ctx->uid();
@@ -52,6 +220,16 @@ static int Getattr(const char *path, struct stat *st) {
 
     File *file = FindFile(path, ctx);
     if (file != nullptr) {
+        unique_lock<mutex> attrGuard(file->attrLock);
+        if (file->infoPending) {
+            attrGuard.unlock();
+            {
+                lock_guard<mutex> fileGuard(file->lock);
+                if (file->infoPending) FetchInfo(path, file, ctx);
+            }
+            attrGuard.lock();
+        }
+        st->st_ino = file->ino;
         st->st_mode = S_IFREG | 0644;
         st->st_nlink = 1;
         st->st_size = file->size;
@@ -64,91 +242,134 @@ static int Getattr(const char *path, struct stat *st) {
     return -ENOENT;
 }
 
+/*
+ * Attributes of the preview of a node. The size of a file's preview is only
+ * known once it is fetched, and is kept from then on; files without one
+ * show up empty.
+ */
+static int GetattrPreview(const string& path, struct stat *st,
+        Context *ctx) {
+    st->st_uid = ctx->uid();
+    st->st_gid = ctx->gid();
+    Dir *dir = FindDir(path, ctx);
+    if (dir != nullptr) {
+        st->st_ino = PreviewIno(dir->ino);
+        st->st_mode = S_IFDIR | 0555;
+        st->st_nlink = 2;
+        return 0;
+    }
+
+    File *file = FindFile(path, ctx);
+    if (file == nullptr) return -ENOENT;
+    off_t size = 0;
+    {
+        lock_guard<mutex> fileGuard(file->lock);
+        if (!file->changed && file->previewSize < 0 &&
+                file->previewError == 0) {
+            shared_ptr<Block> preview;
+            GetPreview(file, IO_READ, &preview, ctx);
+        }
+        if (!file->changed && file->previewSize > 0) size = file->previewSize;
+    }
+    st->st_ino = PreviewIno(file->ino);
+    st->st_mode = S_IFREG | 0444;
+    st->st_nlink = 1;
+    st->st_size = size;
+    st->st_blocks = SizeToBlocks(st->st_size);
+    lock_guard<mutex> attrGuard(file->attrLock);
+    st->st_mtime = file->mtime;
+    return 0;
+}
+
 /*
  * File ops
  */
 File* FindFile(const string& path, Context *ctx) {
-    size_t pos = path.rfind("/");
-    Dir *dir;
-    string name;
-    if (pos == string::npos) {
-        Warn("path has no /");
-        dir = &ctx->root();
-        name = path;
-        if (!dir->listed) ListDir("/", dir, ctx);
-    } else {
-        string parentPath = path.substr(0, pos + 1);
-        dir = FindDir(parentPath, ctx);
-        if (dir == nullptr) {
-            return nullptr;
-        }
-        name = path.substr(pos + 1);
-        if (!dir->listed) ListDir(parentPath.c_str(), dir, ctx);
+    File *file = ctx->index().findFile(path);
+    if (file != nullptr) return file;
+
+    // Not indexed yet if the parent has not been listed.
+    Dir *dir = FindDir(DirName(path), ctx);
+    if (dir == nullptr) return nullptr;
+    if (dir->listed) {
+        // may have been added on the camera since
+        RevalidateStale(dir, ctx);
+        return nullptr;
     }
-    return dir->getFile(name);
+    ListDir(dir, ctx);
+    // the crawl hasn't got here yet, what is around is likely asked next
+    ctx->crawler().boost(dir->path);
+    return dir->getFile(BaseName(path));
 }
 
 static int Create(const char *path, mode_t mode,
         struct fuse_file_info *fileInfo) {
-    Context *ctx = (Context *)fuse_get_context()->private_data;
-    lock_guard<mutex> guard(ctx->lock());
+    Context *ctx = CurrentContext();
+    OpTimer timer(ctx, STAT_CREATE, path);
+    OpGuard op(ctx);
 
-    const char *dirName = dirname(path);
-    const char *fileName = basename(path);
+    string realPath;
+    if (PreviewPath(path, &realPath, ctx)) return -EROFS;
+    if (StatsPath(path) != STATS_NONE) return -EROFS;
+
+    string dirName = DirName(path);
+    string fileName = BaseName(path);
 
     Dir *dir = FindDir(dirName, ctx);
     if (dir == nullptr) {
-        Warn("parent dir does not exist");
+        LOG_WARN("parent dir does not exist");
         return -ENOENT;
     }
 
-    if (dir->getFile(fileName) != nullptr) {
-        return -EEXIST;
-    }
-
     File *file = new File(fileName);
     file->changed = true;
-    dir->addFile(file);
-
-    if (file->camFile == nullptr) {
-        const char *dirName = dirname(path);
-        const char *fileName = basename(path);
-        CameraFile *camFile;
-        gp_file_new(&camFile);
-        file->camFile = camFile;
+    file->ref++;
+    if (!dir->addFile(file)) {
+        delete file;
+        return -EEXIST;
     }
 
     FileDesc *fd = new FileDesc();
     fd->writeable = true;
     fd->file = file;
-    file->ref++;
     fileInfo->fh = (uint64_t)fd;
     return 0;
 }
 
+static int OpenPreview(const string& path, struct fuse_file_info *fileInfo,
+        Context *ctx);
+static void PrefetchNext(const string& path, File *file, Context *ctx);
+
 static int Open(const char *path, struct fuse_file_info *fileInfo) {
-    Context *ctx = (Context *)fuse_get_context()->private_data;
-    lock_guard<mutex> guard(ctx->lock());
+    Context *ctx = CurrentContext();
+    OpTimer timer(ctx, STAT_OPEN, path);
+    OpGuard op(ctx);
+    StatsNode stats = StatsPath(path);
+    if (stats != STATS_NONE) return OpenStats(stats, fileInfo, ctx);
+    string realPath;
+    if (PreviewPath(path, &realPath, ctx)) {
+        return OpenPreview(realPath, fileInfo, ctx);
+    }
     File *file = FindFile(path, ctx);
     if (file == nullptr) {
         return -ENOENT;
     }
-    lock_guard<mutex> fileGuard(file->lock);
-    if (file->camFile == nullptr) {
-        const char *dirName = dirname(path);
-        const char *fileName = basename(path);
-        CameraFile *camFile;
-        gp_file_new(&camFile);
-        int ret = gp_camera_file_get(ctx->camera(), dirName, fileName,
-                GP_FILE_TYPE_NORMAL, camFile, ctx->context());
-        if (ret != GP_OK) {
-            gp_file_unref(camFile);
-            return gpresultToErrno(ret);
-        }
-        file->camFile = camFile;
+    unique_lock<mutex> fileGuard(file->lock);
+    if (file->unlinked) {
+        return -ENOENT;
     }
-    FileDesc *fd = new FileDesc();
     int mode = fileInfo->flags & 3;
+    // Given with FUSE_CAP_ATOMIC_O_TRUNC, the old contents are not needed.
+    if ((fileInfo->flags & O_TRUNC) && mode != O_RDONLY) {
+        int ret = TruncateFile(path, file, 0, ctx);
+        if (ret != 0) return ret;
+    }
+    if (file->infoPending) {
+        int ret = FetchInfo(path, file, ctx);
+        if (ret != 0) return ret;
+    }
+    // Contents are fetched block by block in Read() and Write().
+    FileDesc *fd = new FileDesc();
     if (mode == O_RDONLY) {
         fd->writeable = false;
     } else {
@@ -157,346 +378,1845 @@ static int Open(const char *path, struct fuse_file_info *fileInfo) {
     fd->file = file;
     file->ref++;
     fileInfo->fh = (uint64_t)fd;
+
+    if (file->cacheFd < 0 && !file->changed) {
+        file->cacheFd = ctx->diskCache().open(CacheKey(path, file, ctx));
+    }
+    fileGuard.unlock();
+
+    if (mode == O_RDONLY) {
+        PrefetchNext(path, file, ctx);
+    }
+    return 0;
+}
+
+/*
+ * Loads a whole file into the content cache at background priority, unless
+ * it is open or can be read from the disk cache.
+ */
+static void PrefetchFile(const string& path, Context *ctx) {
+    uint64_t blocks;
+    {
+        OpGuard op(ctx);
+        File *file = ctx->index().findFile(path);
+        if (file == nullptr) return;
+        lock_guard<mutex> fileGuard(file->lock);
+        if (file->ref > 0 || file->changed) return;
+        int fd = ctx->diskCache().open(CacheKey(path, file, ctx));
+        if (fd >= 0) {
+            close(fd);
+            return;
+        }
+        blocks = (file->camSize + BlockCache::kBlockSize - 1) /
+            BlockCache::kBlockSize;
+    }
+    PrefetchBlocks(path, 0, blocks, IO_BACKGROUND, ctx->prefetch(), ctx);
+}
+
+/*
+ * When the files of a dir are opened one after another in listing order,
+ * as import tools do, loads the next ones while the current one is being
+ * processed. At most prefetch_files of them are ahead, within
+ * prefetch_size MiB and half of the content cache.
+ */
+static void PrefetchNext(const string& path, File *file, Context *ctx) {
+    size_t count = ctx->options().prefetchFiles;
+    if (count == 0) return;
+    string dirName = DirName(path);
+    Dir *dir = FindDir(dirName, ctx);
+    if (dir == nullptr) return;
+    off_t budget = min((off_t)ctx->options().prefetchSize << 20,
+            (off_t)ctx->cache().budget() / 2);
+
+    vector<string> next;
+    {
+        lock_guard<mutex> openGuard(dir->openLock);
+        ReadGuard guard(dir->lock);
+        auto it = dir->files.find(file->name);
+        if (it == dir->files.end() || dir->lastOpened == file->name) return;
+        bool sequential = it != dir->files.begin() &&
+            prev(it)->first == dir->lastOpened;
+        dir->lastOpened = file->name;
+        if (!sequential) return;
+
+        off_t bytes = 0;
+        for (it++; it != dir->files.end() && count > 0; it++, count--) {
+            {
+                lock_guard<mutex> attrGuard(it->second->attrLock);
+                bytes += it->second->size;
+            }
+            if (bytes > budget) break;
+            // scheduled by an earlier open
+            if (it->first <= dir->prefetchedTo) continue;
+            next.push_back(it->first);
+        }
+        if (!next.empty()) dir->prefetchedTo = next.back();
+    }
+    for (const string& name : next) {
+        string filePath = ChildPath(dirName, name);
+        ctx->prefetch().submit([ctx, filePath] {
+            PrefetchFile(filePath, ctx);
+        });
+    }
+}
+
+/*
+ * Previews are read-only, and don't touch the contents of the file.
+ */
+static int OpenPreview(const string& path, struct fuse_file_info *fileInfo,
+        Context *ctx) {
+    if ((fileInfo->flags & 3) != O_RDONLY) return -EROFS;
+    File *file = FindFile(path, ctx);
+    if (file == nullptr) {
+        return FindDir(path, ctx) != nullptr ? -EISDIR : -ENOENT;
+    }
+    lock_guard<mutex> fileGuard(file->lock);
+    if (file->unlinked) {
+        return -ENOENT;
+    }
+    FileDesc *fd = new FileDesc();
+    fd->writeable = false;
+    fd->file = file;
+    fd->preview = true;
+    file->ref++;
+    fileInfo->fh = (uint64_t)fd;
     return 0;
 }
 
+/*
+ * Drops what is only kept while a file is open. file->lock must be held.
+ */
+static void CloseFile(File *file) {
+    file->download.reset();
+    if (file->cacheFd >= 0) {
+        close(file->cacheFd);
+        file->cacheFd = -1;
+    }
+}
+
 static int Release(const char *path, struct fuse_file_info *fileInfo) {
-    Context *ctx = (Context *)fuse_get_context()->private_data;
-    lock_guard<mutex> guard(ctx->lock());
+    Context *ctx = CurrentContext();
+    OpTimer timer(ctx, STAT_RELEASE, path);
     FileDesc *fd = (FileDesc *)fileInfo->fh;
+    if (fd->stats) {
+        delete fd;
+        return 0;
+    }
     File *file = fd->file;
-    lock_guard<mutex> fileGuard(file->lock);
+    unique_lock<mutex> fileGuard(file->lock);
+    bool preview = fd->preview;
     delete fd;
-    file->ref--;
 
-    if (file->changed) {
-        if (file->buf == nullptr) {
-            file->buf = new char[1];
-        }
+    if (preview) {
+        file->ref--;
+        if (file->ref == 0) CloseFile(file);
+        return 0;
+    }
 
-        int ret = gp_file_set_data_and_size(file->camFile, file->buf, file->size);
-        if (ret != GP_OK) {
-            return gpresultToErrno(ret);
-        }
+    if (file->changed && ctx->uploads().started()) {
+        // The reference is handed over to the upload queue. Don't hold the
+        // lock while waiting for room, the upload thread may need it.
+        uint64_t bytes = file->size;
+        fileGuard.unlock();
+        ctx->uploads().push(file, bytes);
+        return 0;
+    }
 
-        const char *dirName = dirname(path);
-        const char *fileName = basename(path);
-        ret = gp_camera_file_delete(ctx->camera(), dirName, fileName,
-                ctx->context());
-        if (ret != GP_OK) {
-            // For newly created file, this is expected
-//            Warn(string("fail to delete ") + path);
-        }
-        ret = gp_camera_folder_put_file(ctx->camera(), dirName, fileName,
-                GP_FILE_TYPE_NORMAL, file->camFile, ctx->context());
-        if (ret != GP_OK) {
-            return gpresultToErrno(ret);
+    file->ref--;
+    if (file->changed) {
+        int ret = UploadFile(path, file, IO_READ, ctx);
+        if (ret != 0) {
+            return ret;
         }
-        file->buf = nullptr;
-        file->changed = false;
     }
 
     if (file->ref == 0) {
-        gp_file_unref(file->camFile);
-        file->camFile = nullptr;
+        CloseFile(file);
     }
     return 0;
 }
 
-static int ReadWholeFile(File *file) {
-    const char *data;
-    unsigned long dataSize;
-    int ret = gp_file_get_data_and_size(file->camFile, &data, &dataSize);
-    if (ret == GP_OK) {
-        file->buf = new char[dataSize];
-        file->size = dataSize;
-        file->changed = false;
-        memcpy(file->buf, data, dataSize);
-        return 0;
-    } else {
-        return gpresultToErrno(ret);
+/*
+ * Uploads a file taken from the upload queue, and drops the reference the
+ * queue held. If the upload fails, the file stays dirty with its contents
+ * kept, and the queue keeps the reference to try again later. On the last
+ * try before unmounting, the reference is dropped anyway and the file is
+ * left to UploadDirty().
+ */
+static bool UploadQueued(File *file, bool last, Context *ctx) {
+    lock_guard<mutex> fileGuard(file->lock);
+    if (file->changed) {
+        int ret = UploadFile(file->path, file, IO_BACKGROUND, ctx);
+        if (ret != 0 && !last) {
+            LOG_WARN("upload failed, will retry: " + file->path);
+            return false;
+        }
+    }
+    file->ref--;
+    if (file->ref == 0) {
+        CloseFile(file);
     }
+    return true;
 }
 
-static int Read(const char *path, char *buf, size_t size, off_t offset,
-        struct fuse_file_info *fileInfo) {
-    Context *ctx = (Context *)fuse_get_context()->private_data;
+/*
+ * Tries once more to upload the files under dir that are still dirty, at
+ * unmount, when nothing else is running. Changes that don't make it are
+ * lost.
+ */
+static void UploadDirty(Dir *dir, Context *ctx) {
+    vector<File*> files;
+    vector<Dir*> dirs;
+    {
+        ReadGuard guard(dir->lock);
+        for (auto& it : dir->files) files.push_back(it.second);
+        for (auto& it : dir->dirs) dirs.push_back(it.second);
+    }
+    for (File *file : files) {
+        lock_guard<mutex> fileGuard(file->lock);
+        if (!file->changed) continue;
+        int ret = UploadFile(file->path, file, IO_BACKGROUND, ctx);
+        if (ret != 0) {
+            LOG_ERROR("upload failed, changes lost: " + file->path + ": " +
+                    strerror(-ret));
+        }
+    }
+    for (Dir *subDir : dirs) {
+        UploadDirty(subDir, ctx);
+    }
+}
 
-    FileDesc *fd = (FileDesc *)fileInfo->fh;
-    File *file = fd->file;
-    lock_guard<mutex> guard(file->lock);
+/*
+ * Key of the camera object in the disk cache.
+ */
+static string CacheKey(const string& path, File *file, Context *ctx) {
+    return ctx->deviceId() + "|" + path + "|" + to_string(file->mtime) +
+        "|" + to_string(file->camSize);
+}
 
-    if (file->buf == nullptr) {
-        int ret = ReadWholeFile(file);
-        if (ret != 0) return ret;
-    }
+// Downloads are only written to.
+static int DownloadSize(void *priv, uint64_t *size) {
+    return GP_ERROR_NOT_SUPPORTED;
+}
 
-    if (offset < file->size) {
-        if (offset + size > file->size) {
-            size = file->size - offset;
-        }
-        memcpy(buf, file->buf + offset, size);
-        return size;
-    } else {
-        return 0;
+static int DownloadRead(void *priv, unsigned char *data, uint64_t *len) {
+    return GP_ERROR_NOT_SUPPORTED;
+}
+
+static int DownloadWrite(void *priv, unsigned char *data, uint64_t *len) {
+    if (((Download *)priv)->append((const char *)data, *len) != 0) {
+        return GP_ERROR_IO_WRITE;
     }
+    return GP_OK;
 }
 
-static int Write(const char *path, const char *buf, size_t size, off_t offset,
-        struct fuse_file_info *fileInfo) {
-    Context *ctx = (Context *)fuse_get_context()->private_data;
+static CameraFileHandler DownloadHandler = {
+    DownloadSize, DownloadRead, DownloadWrite
+};
 
-    FileDesc *fd = (FileDesc *)fileInfo->fh;
-    File *file = fd->file;
-    lock_guard<mutex> guard(file->lock);
+/*
+ * Copies a finished download into the disk cache, block by block, so that
+ * it doesn't need to be in memory as a whole.
+ */
+static void StoreDownload(Download *download, const string& key,
+        off_t size, Context *ctx) {
+    vector<char> buf(BlockCache::kBlockSize);
+    for (off_t pos = 0; pos < size; pos += buf.size()) {
+        size_t len = min((off_t)buf.size(), size - pos);
+        if (download->read(buf.data(), len, pos) != (int)len) return;
+        ctx->diskCache().store(key, size, pos, buf.data(), len);
+    }
+}
 
-    if (file->buf == nullptr) {
-        int ret = ReadWholeFile(file);
-        if (ret != 0) return ret;
+/*
+ * Starts downloading the whole object on the camera thread, unless it is
+ * being downloaded already, at the priority of the read that needs it.
+ * The contents go to a temp file, in the cache dir if there is one.
+ * file->lock must be held.
+ */
+static shared_ptr<Download> StartDownload(const string& path, File *file,
+        IoPriority priority, Context *ctx) {
+    if (file->download != nullptr && !file->download->failed()) {
+        return file->download;
     }
+    int fd = TempFile(ctx->options().cacheDir, "download");
+    shared_ptr<Download> download = make_shared<Download>(fd);
+    file->download = download;
+    if (fd < 0) {
+        download->finish(fd);
+        return download;
+    }
+
+    string dirName = DirName(path);
+    string fileName = BaseName(path);
+    string key = CacheKey(path, file, ctx);
+    off_t camSize = file->camSize;
+    ctx->io().submit(priority, [=] {
+        CameraFile *camFile;
+        int ret = gp_file_new_from_handler(&camFile, &DownloadHandler,
+                download.get());
+        if (ret == GP_OK) {
+            ctx->stats().downloadsRunning++;
+            ret = ctx->camera().getFile(dirName, fileName,
+                    GP_FILE_TYPE_NORMAL, camFile);
+            ctx->stats().downloadsRunning--;
+            gp_file_unref(camFile);
+        }
+        ctx->stats().bytesRead += download->received();
+        if (ret != GP_OK) {
+            download->finish(gpresultToErrno(ret));
+            return ret;
+        }
+        download->finish(0);
+        if (download->received() == camSize &&
+                ctx->diskCache().enabled()) {
+            StoreDownload(download.get(), key, camSize, ctx);
+        }
+        return ret;
+    });
+    return download;
+}
 
-    if (offset + size > file->size) {
-        char *newBuf = (char*)realloc(file->buf, offset + size);
-        if (newBuf == nullptr) {
-            return -EFBIG;
+/*
+ * Reads [offset, offset + size) directly from the camera, without
+ * downloading the rest of the file.
+ * Returns the number of bytes read, or -ENOTSUP if the driver does not
+ * support partial reads.
+ */
+static int ReadRange(const string& path, char *buf, size_t size,
+        off_t offset, IoPriority priority, Context *ctx) {
+    string dirName = DirName(path);
+    string fileName = BaseName(path);
+    size_t done = 0;
+    while (done < size) {
+        uint64_t got = size - done;
+        int ret = ctx->io().run(priority, [&] {
+            return ctx->camera().readFile(dirName, fileName, offset + done,
+                    buf + done, &got);
+        });
+        if (ret == GP_ERROR_NOT_SUPPORTED) {
+            LOG_DEBUG("ranged read not supported, fallback: " + path);
+            ctx->setRangedReads(false);
+            return -ENOTSUP;
+        }
+        if (ret != GP_OK) {
+            return gpresultToErrno(ret);
         }
-        file->size = offset + size;
-        file->buf = newBuf;
+        if (got == 0) {
+            break;
+        }
+        ctx->stats().bytesRead += got;
+        done += got;
     }
-    memcpy(file->buf + offset, buf, size);
-    file->changed = true;
-    return size;
+    return done;
 }
 
-static int Flush(const char *path, struct fuse_file_info *fileInfo) {
-    Context *ctx = (Context *)fuse_get_context()->private_data;
+/*
+ * Reads part of the object on the camera, with a ranged read if possible.
+ * Otherwise it comes from the download of the whole file, shared by all
+ * readers and kept in a temp file while the file is open. fileGuard is
+ * held on entry and exit, and released during the transfer.
+ */
+static int ReadCamera(const string& path, File *file, char *buf, size_t size,
+        off_t offset, unique_lock<mutex>& fileGuard, IoPriority priority,
+        Context *ctx) {
+    shared_ptr<Download> download;
+    if (file->download != nullptr || !ctx->rangedReads()) {
+        download = StartDownload(path, file, priority, ctx);
+    }
+    fileGuard.unlock();
 
-    FileDesc *fd = (FileDesc *)fileInfo->fh;
-    File *file = fd->file;
+    int ret = -ENOTSUP;
+    if (download == nullptr) {
+        ret = ReadRange(path, buf, size, offset, priority, ctx);
+    }
+    if (ret == -ENOTSUP) {
+        if (download == nullptr) {
+            fileGuard.lock();
+            download = StartDownload(path, file, priority, ctx);
+            fileGuard.unlock();
+        }
+        ret = download->read(buf, size, offset);
+    }
 
-    return 0;
+    fileGuard.lock();
+    return ret;
 }
 
-static int Truncate(const char *path, off_t size) {
-    Context *ctx = (Context *)fuse_get_context()->private_data;
-
-    File *file = FindFile(path, ctx);
-    lock_guard<mutex> guard(file->lock);
+static int FetchBlock(const string& path, File *file, uint64_t index,
+        shared_ptr<Block> *block, unique_lock<mutex>& fileGuard,
+        IoPriority priority, Context *ctx) {
+    while (true) {
+        *block = ctx->cache().get(file, index);
+        if (*block) {
+            ctx->stats().cacheHits++;
+            return 0;
+        }
+        if (file->fetching.count(index) > 0) {
+            file->fetched.wait(fileGuard);
+            continue;
+        }
 
-    if (file->size > size) {
-        size = file->size;
+        off_t start = index * BlockCache::kBlockSize;
+        off_t end = min(start + (off_t)BlockCache::kBlockSize, file->size);
+        off_t camEnd = min(end, file->camSize);
+
+        shared_ptr<Block> newBlock = make_shared<Block>();
+        if (camEnd > start && file->cacheFd >= 0) {
+            newBlock->data.resize(camEnd - start);
+            ssize_t ret = pread(file->cacheFd, newBlock->data.data(),
+                    camEnd - start, start);
+            if (ret < 0) {
+                return -errno;
+            }
+            newBlock->data.resize(ret);
+            ctx->stats().diskHits++;
+        } else if (camEnd > start) {
+            ctx->stats().cacheMisses++;
+            uint64_t epoch = file->epoch;
+            file->fetching.insert(index);
+            newBlock->data.resize(camEnd - start);
+            int ret = ReadCamera(path, file, newBlock->data.data(),
+                    camEnd - start, start, fileGuard, priority, ctx);
+            file->fetching.erase(index);
+            file->fetched.notify_all();
+            if (ret < 0) {
+                return ret;
+            }
+            // Dropped or overwritten while the lock was released.
+            if (epoch != file->epoch || ctx->cache().get(file, index)) {
+                continue;
+            }
+            newBlock->data.resize(ret);
+            if (ret == camEnd - start && !file->changed) {
+                ctx->diskCache().store(CacheKey(path, file, ctx),
+                        file->camSize, start, newBlock->data.data(), ret);
+            }
+        }
+        ctx->cache().put(file, index, newBlock);
+        *block = newBlock;
+        return 0;
     }
-
-    return 0;
 }
 
-static int Unlink(const char *path) {
-    Context *ctx = (Context *)fuse_get_context()->private_data;
-    lock_guard<mutex> guard(ctx->lock());
-    const char *dirName = dirname(path);
-    const char *fileName = basename(path);
+/*
+ * Gets a block of the file from the content cache, loading it from the
+ * disk cache or the camera on a miss. file->lock must be held, but is
+ * released while reading the camera. Concurrent misses on the same block
+ * wait for the first one instead of reading it again.
+ */
+static int GetBlock(const string& path, File *file, uint64_t index,
+        shared_ptr<Block> *block, Context *ctx) {
+    unique_lock<mutex> fileGuard(file->lock, adopt_lock);
+    int ret = FetchBlock(path, file, index, block, fileGuard, IO_READ, ctx);
+    // still held by the caller
+    fileGuard.release();
+    return ret;
+}
 
-    Dir *dir = FindDir(dirName, ctx);
-    File *file = FindFile(path, ctx);
+/*
+ * Drops cached blocks of a file from index from on. Fetches running at
+ * the time won't add what they read. file->lock must be held.
+ */
+static void DropBlocks(File *file, Context *ctx, uint64_t from = 0) {
+    file->epoch++;
+    ctx->cache().drop(file, from);
+    file->readahead = min(file->readahead, from);
+}
 
-    if (dir == nullptr || file == nullptr) {
-        return -ENOENT;
+/*
+ * Loads blocks [from, to) of a file into the content cache, if it is still
+ * in the tree and not being written. Runs on worker, the readahead or the
+ * prefetch thread.
+ */
+static void PrefetchBlocks(const string& path, uint64_t from, uint64_t to,
+        IoPriority priority, Worker& worker, Context *ctx) {
+    OpGuard op(ctx);
+    File *file = ctx->index().findFile(path);
+    if (file == nullptr) return;
+    unique_lock<mutex> fileGuard(file->lock);
+    for (uint64_t index = from; index < to; index++) {
+        if (worker.stopping() || file->unlinked || file->changed ||
+                file->spillFd >= 0) {
+            break;
+        }
+        shared_ptr<Block> block;
+        int ret = FetchBlock(path, file, index, &block, fileGuard, priority,
+                ctx);
+        if (ret != 0) break;
+    }
+    // a download started here is not needed once its blocks are cached
+    if (file->ref == 0) {
+        CloseFile(file);
+    }
+}
+
+/*
+ * Called after a read of [offset, end) of the file. If it continued the
+ * previous read, keeps the window after it being read ahead, at read
+ * priority since the reader will soon need it. file->lock must be held.
+ */
+static void Readahead(const string& path, File *file, off_t offset,
+        off_t end, Context *ctx) {
+    bool sequential = offset == file->nextRead;
+    file->nextRead = end;
+    off_t window = ctx->options().readahead << 10;
+    if (!sequential || window == 0 || file->changed || file->spillFd >= 0) {
+        return;
+    }
+    uint64_t from = max((uint64_t)(end / BlockCache::kBlockSize),
+            file->readahead);
+    off_t last = min(end + window, file->camSize);
+    uint64_t to = (last + BlockCache::kBlockSize - 1) / BlockCache::kBlockSize;
+    // top up in steps of at least a block
+    if (to <= from) return;
+    file->readahead = to;
+    // on its own thread, so it doesn't wait behind whole files being
+    // prefetched
+    ctx->readahead().submit([=] {
+        PrefetchBlocks(path, from, to, IO_READ, ctx->readahead(), ctx);
+    });
+}
+
+static int ReadBlocks(const string& path, File *file, char *buf, size_t size,
+        off_t offset, Context *ctx) {
+    if (offset >= file->size) {
+        return 0;
+    }
+    if (offset + (off_t)size > file->size) {
+        size = file->size - offset;
+    }
+    if (file->spillFd >= 0) {
+        ssize_t ret = pread(file->spillFd, buf, size, offset);
+        if (ret < 0) return -errno;
+        // a hole left by the last write reads as zeros
+        memset(buf + ret, 0, size - ret);
+        return size;
+    }
+
+    size_t done = 0;
+    while (done < size) {
+        off_t pos = offset + done;
+        uint64_t index = pos / BlockCache::kBlockSize;
+        size_t inBlock = pos % BlockCache::kBlockSize;
+        size_t len = min(size - done, BlockCache::kBlockSize - inBlock);
+
+        shared_ptr<Block> block;
+        int ret = GetBlock(path, file, index, &block, ctx);
+        if (ret != 0) return ret;
+
+        size_t avail = 0;
+        if (block->data.size() > inBlock) {
+            avail = min(len, block->data.size() - inBlock);
+            memcpy(buf + done, block->data.data() + inBlock, avail);
+        }
+        memset(buf + done + avail, 0, len - avail);
+        done += len;
+    }
+    Readahead(path, file, offset, offset + done, ctx);
+    return done;
+}
+
+/*
+ * Moves the contents of a file to an unlinked temp file, in the cache dir if
+ * there is one, fetching the parts that are still on the camera.
+ */
+static int SpillFile(const string& path, File *file, Context *ctx) {
+    int fd = TempFile(ctx->options().cacheDir, "spill");
+    if (fd < 0) {
+        return fd;
+    }
+
+    for (off_t pos = 0; pos < file->size; pos += BlockCache::kBlockSize) {
+        shared_ptr<Block> block;
+        int ret = GetBlock(path, file, pos / BlockCache::kBlockSize, &block,
+                ctx);
+        if (ret == 0 && pwrite(fd, block->data.data(), block->data.size(),
+                    pos) != (ssize_t)block->data.size()) {
+            ret = -EIO;
+        }
+        if (ret != 0) {
+            close(fd);
+            return ret;
+        }
+    }
+    if (ftruncate(fd, file->size) != 0) {
+        int ret = -errno;
+        close(fd);
+        return ret;
+    }
+    LOG_DEBUG("spilled " + path);
+    file->spillFd = fd;
+    DropBlocks(file, ctx);
+    return 0;
+}
+
+/*
+ * Fetches the blocks of a file that are still only on the camera and pins
+ * them in the cache, as if they had been written. For uploads with
+ * spilling disabled. file->lock must be held.
+ */
+static int PinBlocks(const string& path, File *file, Context *ctx) {
+    off_t end = min(file->size, file->camSize);
+    for (off_t pos = 0; pos < end; pos += BlockCache::kBlockSize) {
+        shared_ptr<Block> block;
+        int ret = GetBlock(path, file, pos / BlockCache::kBlockSize, &block,
+                ctx);
+        if (ret != 0) return ret;
+        if (block->dirty) continue;
+        block->dirty = true;
+        ctx->cache().put(file, pos / BlockCache::kBlockSize, block);
+    }
+    return 0;
+}
+
+static int WriteBlocks(const string& path, File *file, const char *buf,
+        size_t size, off_t offset, Context *ctx) {
+    off_t spillSize = (off_t)ctx->options().spillSize << 20;
+    if (file->spillFd < 0 && spillSize > 0 &&
+            offset + (off_t)size > spillSize) {
+        int ret = SpillFile(path, file, ctx);
+        if (ret != 0) return ret;
+    }
+    if (file->spillFd >= 0) {
+        if (pwrite(file->spillFd, buf, size, offset) != (ssize_t)size) {
+            return -EIO;
+        }
+        if (offset + (off_t)size > file->size) {
+            lock_guard<mutex> attrGuard(file->attrLock);
+            file->size = offset + size;
+        }
+        return size;
+    }
+
+    size_t done = 0;
+    while (done < size) {
+        off_t pos = offset + done;
+        uint64_t index = pos / BlockCache::kBlockSize;
+        size_t inBlock = pos % BlockCache::kBlockSize;
+        size_t len = min(size - done, BlockCache::kBlockSize - inBlock);
+
+        shared_ptr<Block> block;
+        off_t blockEnd = min(pos - (off_t)inBlock +
+                (off_t)BlockCache::kBlockSize, file->size);
+        if (inBlock == 0 && pos + (off_t)len >= blockEnd) {
+            // Overwriting all of the block, no need to fetch it.
+            block = ctx->cache().get(file, index);
+            if (!block) block = make_shared<Block>();
+        } else {
+            int ret = GetBlock(path, file, index, &block, ctx);
+            if (ret != 0) return ret;
+        }
+
+        if (block->data.size() < inBlock + len) {
+            block->data.resize(inBlock + len);
+        }
+        memcpy(block->data.data() + inBlock, buf + done, len);
+        block->dirty = true;
+        ctx->cache().put(file, index, block);
+
+        if (pos + (off_t)len > file->size) {
+            lock_guard<mutex> attrGuard(file->attrLock);
+            file->size = pos + len;
+        }
+        done += len;
+    }
+    return size;
+}
+
+/*
+ * Sets the size of a file. Contents past the new size are dropped, and the
+ * file reads as zeros up to it when extended. Only the head of a partial
+ * last block may have to be fetched, truncating to zero fetches nothing.
+ * file->lock must be held.
+ */
+static int TruncateFile(const string& path, File *file, off_t size,
+        Context *ctx) {
+    if (size < 0) {
+        return -EINVAL;
+    }
+    if (size > 0 && file->infoPending) {
+        int ret = FetchInfo(path, file, ctx);
+        if (ret != 0) return ret;
+    }
+    if (size == file->size && !file->infoPending) {
+        return 0;
+    }
+
+    if (size == 0) {
+        if (file->spillFd >= 0) {
+            close(file->spillFd);
+            file->spillFd = -1;
+        }
+        DropBlocks(file, ctx);
+    } else if (file->spillFd >= 0) {
+        if (ftruncate(file->spillFd, size) != 0) {
+            return -errno;
+        }
+    } else if (size < file->size) {
+        uint64_t index = size / BlockCache::kBlockSize;
+        size_t inBlock = size % BlockCache::kBlockSize;
+        if (inBlock > 0) {
+            shared_ptr<Block> block;
+            int ret = GetBlock(path, file, index, &block, ctx);
+            if (ret != 0) return ret;
+            if (block->data.size() > inBlock) {
+                block->data.resize(inBlock);
+            }
+            block->dirty = true;
+            ctx->cache().put(file, index, block);
+            index++;
+        }
+        DropBlocks(file, ctx, index);
+    }
+
+    lock_guard<mutex> attrGuard(file->attrLock);
+    file->size = size;
+    // What was cut off must read as zeros if the file grows again.
+    file->camSize = min(file->camSize, size);
+    file->infoPending = false;
+    file->changed = true;
+    return 0;
+}
+
+// Contents of a file being uploaded, read in order by libgphoto2.
+struct UploadSource {
+    const string *path;
+    File *file;
+    Context *ctx;
+    off_t offset;
+};
+
+static int UploadSize(void *priv, uint64_t *size) {
+    UploadSource *source = (UploadSource *)priv;
+    *size = source->file->size;
+    return GP_OK;
+}
+
+/*
+ * Runs on the camera thread, while the uploader holds file->lock, so
+ * nothing may be fetched here: UploadFile() has put all of the contents in
+ * the spill file or pinned them in the cache. Blocks past camSize that were
+ * never written are holes and read as zeros.
+ */
+static int UploadRead(void *priv, unsigned char *data, uint64_t *len) {
+    UploadSource *source = (UploadSource *)priv;
+    File *file = source->file;
+    Context *ctx = source->ctx;
+    off_t offset = source->offset;
+    uint64_t size = 0;
+    if (offset < file->size) {
+        size = min(*len, (uint64_t)(file->size - offset));
+    }
+
+    if (file->spillFd >= 0) {
+        ssize_t ret = pread(file->spillFd, data, size, offset);
+        if (ret < 0) return GP_ERROR_IO_READ;
+        memset(data + ret, 0, size - ret);
+    } else {
+        uint64_t done = 0;
+        while (done < size) {
+            off_t pos = offset + done;
+            uint64_t index = pos / BlockCache::kBlockSize;
+            size_t inBlock = pos % BlockCache::kBlockSize;
+            size_t chunk = min(size - done,
+                    (uint64_t)(BlockCache::kBlockSize - inBlock));
+            shared_ptr<Block> block = ctx->cache().get(file, index);
+            if (!block && pos < file->camSize) {
+                LOG_ERROR("upload contents not in memory: " + *source->path);
+                return GP_ERROR_IO_READ;
+            }
+            size_t avail = 0;
+            if (block && block->data.size() > inBlock) {
+                avail = min(chunk, block->data.size() - inBlock);
+                memcpy(data + done, block->data.data() + inBlock, avail);
+            }
+            memset(data + done + avail, 0, chunk - avail);
+            done += chunk;
+        }
+    }
+    source->offset += size;
+    *len = size;
+    return GP_OK;
+}
+
+/*
+ * Replaces the object on the camera with the contents of the file. The
+ * contents are streamed from the cache or the spill file; what is still
+ * only in the old object is spilled or pinned first. priority is IO_READ when a caller waits for it, IO_BACKGROUND
+ * for the upload queue.
+ */
+static int UploadFile(const string& path, File *file, IoPriority priority,
+        Context *ctx) {
+    // The old object is deleted before the new one is stored, so nothing
+    // may be left to fetch from it. With spilling disabled, what is left
+    // is kept in memory instead.
+    if (file->spillFd < 0 && file->camSize > 0) {
+        int ret = ctx->options().spillSize == 0 ?
+                PinBlocks(path, file, ctx) : SpillFile(path, file, ctx);
+        if (ret != 0) return ret;
+    }
+
+    UploadSource source = {&path, file, ctx, 0};
+    CameraFileHandler handler = {UploadSize, UploadRead, nullptr};
+    CameraFile *camFile;
+    int ret = gp_file_new_from_handler(&camFile, &handler, &source);
+    if (ret != GP_OK) {
+        return gpresultToErrno(ret);
+    }
+
+    string dirName = DirName(path);
+    string fileName = BaseName(path);
+    ret = ctx->io().run(priority, [&] {
+        return ctx->camera().deleteFile(dirName, fileName);
+    });
+    if (ret != GP_OK) {
+        // For newly created file, this is expected
+//        LOG_WARN(string("fail to delete ") + path);
+    }
+    ctx->diskCache().remove(CacheKey(path, file, ctx));
+    if (file->cacheFd >= 0) {
+        close(file->cacheFd);
+        file->cacheFd = -1;
+    }
+    ret = ctx->io().run(priority, [&] {
+        return ctx->camera().putFile(dirName, fileName, camFile);
+    });
+    gp_file_unref(camFile);
+    if (ret != GP_OK) {
+        return gpresultToErrno(ret);
+    }
+
+    ctx->stats().bytesWritten += file->size;
+    file->camSize = file->size;
+    file->changed = false;
+    if (file->spillFd >= 0) {
+        // Fetch it again from the camera when needed.
+        close(file->spillFd);
+        file->spillFd = -1;
+        DropBlocks(file, ctx);
+    } else {
+        ctx->cache().clean(file);
+    }
+    // the whole file download and what was fetched about the old object
+    // are stale now
+    file->epoch++;
+    file->download.reset();
+    ForgetPreview(file, ctx);
+    {
+        lock_guard<mutex> attrGuard(file->attrLock);
+        file->xattrs.clear();
+    }
+    file->xattrsLoaded = false;
+    return 0;
+}
+
+// Takes the lock of a file for a read or write, timing the wait.
+static unique_lock<mutex> LockFile(File *file, Context *ctx) {
+    StatTimer timer(ctx->stats().fileLockWait);
+    return unique_lock<mutex>(file->lock);
+}
+
+static int Read(const char *path, char *buf, size_t size, off_t offset,
+        struct fuse_file_info *fileInfo) {
+    Context *ctx = CurrentContext();
+    OpTimer timer(ctx, STAT_READ, path, size);
+
+    FileDesc *fd = (FileDesc *)fileInfo->fh;
+    if (fd->stats) {
+        if ((size_t)offset >= fd->report.size()) return 0;
+        size = min(size, fd->report.size() - offset);
+        memcpy(buf, fd->report.data() + offset, size);
+        return size;
+    }
+    File *file = fd->file;
+    unique_lock<mutex> guard = LockFile(file, ctx);
+
+    if (fd->preview) {
+        shared_ptr<Block> preview;
+        int ret = GetPreview(file, IO_READ, &preview, ctx);
+        if (ret != 0) return ret;
+        if ((size_t)offset >= preview->data.size()) return 0;
+        size = min(size, preview->data.size() - offset);
+        memcpy(buf, preview->data.data() + offset, size);
+        return size;
+    }
+    return ReadBlocks(path, file, buf, size, offset, ctx);
+}
+
+static int Write(const char *path, const char *buf, size_t size, off_t offset,
+        struct fuse_file_info *fileInfo) {
+    Context *ctx = CurrentContext();
+    OpTimer timer(ctx, STAT_WRITE, path, size);
+
+    FileDesc *fd = (FileDesc *)fileInfo->fh;
+    if (fd->stats) {
+        ctx->stats().reset();
+        return size;
+    }
+    File *file = fd->file;
+    unique_lock<mutex> guard = LockFile(file, ctx);
+
+    file->changed = true;
+    return WriteBlocks(path, file, buf, size, offset, ctx);
+}
+
+static int Flush(const char *path, struct fuse_file_info *fileInfo) {
+    Context *ctx = CurrentContext();
+    OpTimer timer(ctx, STAT_FLUSH, path);
+
+    FileDesc *fd = (FileDesc *)fileInfo->fh;
+    File *file = fd->file;
+    if (fd->stats) return 0;
+
+    // Changes are uploaded on release, but earlier closes of this file
+    // may still be queued.
+    if (ctx->uploads().started()) {
+        ctx->uploads().wait(file);
+    }
+    return 0;
+}
+
+static int Fsync(const char *path, int dataSync,
+        struct fuse_file_info *fileInfo) {
+    Context *ctx = CurrentContext();
+    OpTimer timer(ctx, STAT_FSYNC, path);
+
+    FileDesc *fd = (FileDesc *)fileInfo->fh;
+    File *file = fd->file;
+    if (fd->preview || fd->stats) return 0;
+
+    if (!ctx->uploads().started()) {
+        lock_guard<mutex> guard(file->lock);
+        if (!file->changed) return 0;
+        return UploadFile(path, file, IO_READ, ctx);
+    }
+
+    bool changed;
+    uint64_t bytes;
+    {
+        lock_guard<mutex> guard(file->lock);
+        changed = file->changed;
+        bytes = file->size;
+        // held by the queue until the upload is done
+        if (changed) file->ref++;
+    }
+    if (changed) {
+        ctx->uploads().push(file, bytes);
+    }
+    ctx->uploads().wait(file);
+    lock_guard<mutex> guard(file->lock);
+    return file->changed ? -EIO : 0;
+}
+
+static int Truncate(const char *path, off_t size) {
+    Context *ctx = CurrentContext();
+    OpTimer timer(ctx, STAT_TRUNCATE, path);
+    OpGuard op(ctx);
+
+    StatsNode stats = StatsPath(path);
+    if (stats == STATS_TEXT || stats == STATS_JSON) {
+        ctx->stats().reset();
+        return 0;
+    }
+    if (stats != STATS_NONE) return stats == STATS_DIR ? -EISDIR : -ENOENT;
+
+    string realPath;
+    if (PreviewPath(path, &realPath, ctx)) return -EROFS;
+
+    File *file = FindFile(path, ctx);
+    if (file == nullptr) {
+        return FindDir(path, ctx) != nullptr ? -EISDIR : -ENOENT;
+    }
+    unique_lock<mutex> guard(file->lock);
+    if (file->unlinked) {
+        return -ENOENT;
+    }
+    int ret = TruncateFile(path, file, size, ctx);
+    if (ret != 0 || file->ref > 0 || !file->changed) {
+        return ret;
+    }
+
+    // Not open, so there is no release to upload it.
+    if (ctx->uploads().started()) {
+        file->ref++;
+        uint64_t bytes = file->size;
+        guard.unlock();
+        ctx->uploads().push(file, bytes);
+        return 0;
+    }
+    return UploadFile(path, file, IO_READ, ctx);
+}
+
+static int Ftruncate(const char *path, off_t size,
+        struct fuse_file_info *fileInfo) {
+    Context *ctx = CurrentContext();
+    OpTimer timer(ctx, STAT_TRUNCATE, path);
+
+    FileDesc *fd = (FileDesc *)fileInfo->fh;
+    File *file = fd->file;
+    if (!fd->writeable) {
+        return -EBADF;
+    }
+    if (fd->stats) {
+        ctx->stats().reset();
+        return 0;
+    }
+    lock_guard<mutex> guard(file->lock);
+    return TruncateFile(path, file, size, ctx);
+}
+
+static int Unlink(const char *path) {
+    Context *ctx = CurrentContext();
+    OpTimer timer(ctx, STAT_UNLINK, path);
+    OpGuard op(ctx);
+    string realPath;
+    if (PreviewPath(path, &realPath, ctx)) return -EROFS;
+    if (StatsPath(path) != STATS_NONE) return -EROFS;
+    string dirName = DirName(path);
+    string fileName = BaseName(path);
+
+    Dir *dir = FindDir(dirName, ctx);
+    File *file = FindFile(path, ctx);
+
+    if (dir == nullptr || file == nullptr) {
+        return -ENOENT;
+    }
+    if (ctx->uploads().started()) {
+        ctx->uploads().wait(file);
+    }
+
+    {
+        lock_guard<mutex> fileGuard(file->lock);
+        if (file->unlinked) {
+            return -ENOENT;
+        }
+        if (file->ref > 0) {
+            return -EBUSY;
+        }
+
+        int ret = ctx->io().run(IO_META, [&] {
+            return ctx->camera().deleteFile(dirName, fileName);
+        });
+        if (ret != GP_OK) {
+            return gpresultToErrno(ret);
+        }
+        file->unlinked = true;
+        ctx->diskCache().remove(CacheKey(path, file, ctx));
+    }
+
+    dir->removeFile(file);
+    ctx->cache().drop(file);
+    ctx->previews().drop(file);
+    ctx->retire(file);
+    return 0;
+}
+
+/*
+ * Extended attributes
+ */
+
+/*
+ * Completes the extended attributes of a file: the file info if the listing
+ * didn't come with it, and the EXIF data. A file the camera has no EXIF data
+ * for just keeps the file info. file->lock must be held.
+ */
+// marks a fetch of extended attributes in File::fetching, next to the
+// preview fetch, no block has this index
+static const uint64_t kXattrFetch = UINT64_MAX - 1;
+
+/*
+ * Asks the camera for the attributes of a file: with info set, its file
+ * info, with exif set, its EXIF data. Sets *exifDone if the EXIF data was
+ * read, or the camera has none; what was fetched is kept in xattrs even if
+ * a later call fails.
+ */
+static int FetchXattrs(const string& path, bool info, bool exif,
+        Xattrs *xattrs, bool *exifDone, Context *ctx) {
+    string dirName = DirName(path);
+    string fileName = BaseName(path);
+    if (info) {
+        CameraFileInfo fileInfo;
+        int ret = ctx->io().run(IO_META, [&] {
+            return ctx->camera().getInfo(dirName, fileName, &fileInfo);
+        });
+        if (ret != GP_OK) {
+            return gpresultToErrno(ret);
+        }
+        InfoXattrs(fileInfo, xattrs);
+    }
+    if (!exif) return 0;
+
+    CameraFile *camFile;
+    gp_file_new(&camFile);
+    int ret = ctx->io().run(IO_META, [&] {
+        return ctx->camera().getFile(dirName, fileName, GP_FILE_TYPE_EXIF,
+                camFile);
+    });
+    if (ret == GP_OK) {
+        const char *data;
+        unsigned long size;
+        if (gp_file_get_data_and_size(camFile, &data, &size) == GP_OK) {
+            ctx->stats().bytesRead += size;
+            ExifXattrs((const unsigned char *)data, size, xattrs);
+        }
+    }
+    gp_file_unref(camFile);
+    // a camera that can't extract EXIF data won't later either
+    *exifDone = ret == GP_OK || ret == GP_ERROR_NOT_SUPPORTED;
+    return *exifDone ? 0 : gpresultToErrno(ret);
+}
+
+/*
+ * Completes the extended attributes of a file: the file info if the listing
+ * came without it, and with exif set, the EXIF data. The camera is asked
+ * with fileGuard released, a caller finding a fetch running waits for it
+ * and looks again. fileGuard is held on entry and exit.
+ */
+static int LoadXattrs(const string& path, File *file, bool exif,
+        unique_lock<mutex>& fileGuard, Context *ctx) {
+    while (true) {
+        // not on the camera yet
+        if (file->changed) return 0;
+        bool info;
+        {
+            lock_guard<mutex> attrGuard(file->attrLock);
+            info = file->xattrs.empty();
+        }
+        bool needExif = exif && !file->xattrsLoaded;
+        if (!info && !needExif) return 0;
+        if (file->fetching.count(kXattrFetch) > 0) {
+            file->fetched.wait(fileGuard);
+            continue;
+        }
+
+        file->fetching.insert(kXattrFetch);
+        uint64_t epoch = file->epoch;
+        fileGuard.unlock();
+        Xattrs xattrs;
+        bool exifDone = false;
+        int ret = FetchXattrs(path, info, needExif, &xattrs, &exifDone, ctx);
+        fileGuard.lock();
+        file->fetching.erase(kXattrFetch);
+        file->fetched.notify_all();
+        // written or replaced meanwhile, what was fetched is stale
+        if (epoch != file->epoch || file->changed) continue;
+
+        {
+            lock_guard<mutex> attrGuard(file->attrLock);
+            for (auto& it : xattrs) file->xattrs[it.first] = it.second;
+        }
+        if (exifDone) file->xattrsLoaded = true;
+        return ret;
+    }
+}
+
+/*
+ * Attributes of the root dir: the progress of the crawler, and the calls
+ * made to the camera if the backend counts them.
+ */
+static void RootXattrs(Xattrs *xattrs, Context *ctx) {
+    string progress = ctx->crawler().progress();
+    if (!progress.empty()) (*xattrs)["user.gphotofs2.crawl"] = progress;
+    string counters = ctx->cameraCounters();
+    if (!counters.empty()) (*xattrs)["user.gphotofs2.camera"] = counters;
+}
+
+// Dirs and previews have no extended attributes, except for the above.
+// Neither have the stats files, which are handled before looking up a node.
+static int NoXattrs(const string& path, Context *ctx) {
+    string realPath;
+    if (FindDir(path, ctx) != nullptr || PreviewPath(path, &realPath, ctx)) {
+        return -ENODATA;
+    }
+    return -ENOENT;
+}
+
+// Copies an attribute value or name list, or just gives its size if size is 0.
+static int CopyXattr(const string& data, char *buf, size_t size) {
+    if (size == 0) return data.size();
+    if (size < data.size()) return -ERANGE;
+    memcpy(buf, data.data(), data.size());
+    return data.size();
+}
+
+// The names of attributes, each null terminated.
+static string XattrNames(const Xattrs& xattrs) {
+    string names;
+    for (auto& it : xattrs) {
+        names.append(it.first);
+        names.push_back('\0');
+    }
+    return names;
+}
+
+static int Getxattr(const char *path, const char *name, char *value,
+        size_t size) {
+    Context *ctx = CurrentContext();
+    OpTimer timer(ctx, STAT_GETXATTR, path);
+    OpGuard op(ctx);
+    StatsNode stats = StatsPath(path);
+    if (stats != STATS_NONE) {
+        return stats == STATS_MISSING ? -ENOENT : -ENODATA;
+    }
+    // ACLs, security labels and the like, asked for by ls and cp, are never
+    // there; don't even look up the node
+    if (strncmp(name, "user.", 5) != 0) {
+        return -ENODATA;
+    }
+    File *file = FindFile(path, ctx);
+    if (file == nullptr) {
+        if (strcmp(path, "/") == 0) {
+            Xattrs xattrs;
+            RootXattrs(&xattrs, ctx);
+            auto it = xattrs.find(name);
+            if (it != xattrs.end()) return CopyXattr(it->second, value, size);
+        }
+        return NoXattrs(path, ctx);
+    }
+    // The camera is only asked for the attributes it can have, EXIF data
+    // only when one of its tags is wanted.
+    bool exif = strncmp(name, "user.exif.", 10) == 0;
+    if (exif || strncmp(name, "user.camera.", 12) == 0) {
+        unique_lock<mutex> fileGuard(file->lock);
+        int ret = LoadXattrs(path, file, exif, fileGuard, ctx);
+        if (ret != 0) return ret;
+    }
+
+    lock_guard<mutex> attrGuard(file->attrLock);
+    auto it = file->xattrs.find(name);
+    if (it == file->xattrs.end()) {
+        return -ENODATA;
+    }
+    return CopyXattr(it->second, value, size);
+}
+
+static int Listxattr(const char *path, char *list, size_t size) {
+    Context *ctx = CurrentContext();
+    OpTimer timer(ctx, STAT_LISTXATTR, path);
+    OpGuard op(ctx);
+    StatsNode stats = StatsPath(path);
+    if (stats != STATS_NONE) return stats == STATS_MISSING ? -ENOENT : 0;
+    File *file = FindFile(path, ctx);
+    if (file == nullptr) {
+        if (strcmp(path, "/") == 0) {
+            Xattrs xattrs;
+            RootXattrs(&xattrs, ctx);
+            return CopyXattr(XattrNames(xattrs), list, size);
+        }
+        int ret = NoXattrs(path, ctx);
+        return ret == -ENODATA ? 0 : ret;
+    }
+    // Only what is known already, listing the attributes of a directory of
+    // files shouldn't fetch their EXIF data.
+    lock_guard<mutex> attrGuard(file->attrLock);
+    return CopyXattr(XattrNames(file->xattrs), list, size);
+}
+
+/*
+ * Dir ops
+ */
+
+Dir* FindDir(const string& path, Context *ctx) {
+    size_t end = path.find_last_not_of('/');
+    if (end == string::npos) return &ctx->root();
+    string dirPath = path.substr(0, end + 1);
+
+    Dir *dir = ctx->index().findDir(dirPath);
+    if (dir != nullptr) return dir;
+
+    // Not indexed yet if the parent has not been listed.
+    Dir *parent = FindDir(DirName(dirPath), ctx);
+    if (parent == nullptr || parent->listed) return nullptr;
+    ListDir(parent, ctx);
+    // same as in FindFile()
+    ctx->crawler().boost(parent->path);
+    return parent->getDir(BaseName(dirPath));
+}
+
+static int ListNames(const string& path, bool folders, set<string> *names,
+        Context *ctx, IoPriority priority = IO_META) {
+    int ret = ctx->io().run(priority, [&] {
+        if (folders) {
+            return ctx->camera().listFolders(path, names);
+        } else {
+            return ctx->camera().listFiles(path, names);
+        }
+    });
+    if (ret != GP_OK) {
+        return gpresultToErrno(ret);
+    }
+    return 0;
+}
+
+/*
+ * Lists a dir from the camera, unless it has been listed already.
+ * Camera calls are made without holding the dir lock, the children are
+ * added at the end.
+ */
+static int ListDir(Dir *dir, Context *ctx, IoPriority priority) {
+    if (dir->listed) return 0;
+    lock_guard<mutex> listGuard(dir->listLock);
+    if (dir->listed) return 0;
+
+    const string& path = dir->path;
+    set<string> folderNames, fileNames;
+    int ret = ListNames(path, true, &folderNames, ctx, priority);
+    if (ret != 0) return ret;
+    ret = ListNames(path, false, &fileNames, ctx, priority);
+    if (ret != 0) return ret;
+
+    // Large folders are listed by name first, so that they show up without
+    // waiting for the info of every file.
+    size_t threshold = ctx->options().listThreshold;
+    bool lazyInfo = ctx->options().lazyInfo ||
+        (threshold > 0 && fileNames.size() > threshold);
+    vector<unique_ptr<File>> files;
+    for (const string& name : fileNames) {
+        unique_ptr<File> file;
+        if (lazyInfo) {
+            file.reset(new File(name, 0, 0));
+            file->infoPending = true;
+        } else {
+            CameraFileInfo info;
+            ret = ctx->io().run(priority, [&] {
+                return ctx->camera().getInfo(path, name, &info);
+            });
+            if (ret != GP_OK) {
+                return gpresultToErrno(ret);
+            }
+            file.reset(new File(name, info));
+        }
+        files.push_back(move(file));
+    }
+
+    for (const string& name : folderNames) {
+        unique_ptr<Dir> subDir(new Dir(name));
+        if (dir->addDir(subDir.get())) subDir.release();
+        LOG_DEBUG("child dir : " + name + " (" + path + ")");
+    }
+    for (auto& file : files) {
+        if (dir->addFile(file.get())) file.release();
+    }
+    for (const string& name : fileNames) {
+        LOG_DEBUG("child file: " + name + " (" + path + ")");
+    }
+
+    if (lazyInfo && !fileNames.empty()) {
+        string dirPath = path;
+        ctx->background().submit([ctx, dirPath] {
+            FetchPendingInfo(dirPath, ctx);
+        });
+    }
+
+    dir->listedAt = Now();
+    dir->listed = true;
+    return 0;
+}
+
+/*
+ * Fills in size and mtime of a file listed with lazy_info.
+ * file->lock must be held.
+ */
+static int FetchInfo(const string& path, File *file, Context *ctx,
+        IoPriority priority) {
+    string dirName = DirName(path);
+    string fileName = BaseName(path);
+    CameraFileInfo info;
+    int ret = ctx->io().run(priority, [&] {
+        return ctx->camera().getInfo(dirName, fileName, &info);
+    });
+    lock_guard<mutex> attrGuard(file->attrLock);
+    // Don't ask again, a file that can't be stat()ed has size 0.
+    file->infoPending = false;
+    if (ret != GP_OK) {
+        return gpresultToErrno(ret);
+    }
+    file->size = info.file.size;
+    file->camSize = info.file.size;
+    file->mtime = info.file.mtime;
+    InfoXattrs(info, &file->xattrs);
+    return 0;
+}
+
+/*
+ * Fetches the info of the files in a dir that are still pending, one
+ * file at a time, so that Getattr() and friends get the camera in between.
+ */
+static void FetchPendingInfo(const string& path, Context *ctx) {
+    string last;
+    while (!ctx->background().stopping()) {
+        OpGuard op(ctx);
+        Dir *dir = FindDir(path, ctx);
+        if (dir == nullptr) return;
+
+        File *file = nullptr;
+        {
+            ReadGuard guard(dir->lock);
+            for (auto it = dir->files.upper_bound(last);
+                    it != dir->files.end(); it++) {
+                lock_guard<mutex> attrGuard(it->second->attrLock);
+                if (it->second->infoPending) {
+                    file = it->second;
+                    last = it->first;
+                    break;
+                }
+            }
+        }
+        if (file == nullptr) break;
+
+        lock_guard<mutex> fileGuard(file->lock);
+        if (file->infoPending) {
+            FetchInfo(ChildPath(path, last), file, ctx, IO_BACKGROUND);
+        }
+    }
+    LOG_DEBUG("fetched pending info in " + path);
+}
+
+static bool MarkUnlinked(Dir *dir, vector<File*> *marked) {
+    ReadGuard guard(dir->lock);
+    for (auto& it : dir->files) {
+        File *file = it.second;
+        lock_guard<mutex> fileGuard(file->lock);
+        if (file->ref > 0 || file->changed) return false;
+        file->unlinked = true;
+        marked->push_back(file);
+    }
+    for (auto& it : dir->dirs) {
+        if (!MarkUnlinked(it.second, marked)) return false;
+    }
+    return true;
+}
+
+/*
+ * Marks all files under a dir as unlinked, so that they can't be opened
+ * anymore. Fails, and leaves them alone, if any of them is open or dirty.
+ */
+static bool UnlinkTree(Dir *dir) {
+    vector<File*> marked;
+    if (MarkUnlinked(dir, &marked)) return true;
+    for (File *file : marked) {
+        lock_guard<mutex> fileGuard(file->lock);
+        file->unlinked = false;
+    }
+    return false;
+}
+
+static void DropFiles(Dir *dir, Context *ctx) {
+    for (auto& it : dir->files) {
+        ctx->cache().drop(it.second);
+        ctx->previews().drop(it.second);
+    }
+    for (auto& it : dir->dirs) {
+        DropFiles(it.second, ctx);
+    }
+}
+
+/*
+ * Fetches the info of files of a dir again, and drops what is cached of
+ * those that changed on the camera. Open and dirty files are left alone.
+ */
+static void CheckFiles(const string& path, const vector<string>& names,
+        Context *ctx) {
+    for (const string& name : names) {
+        if (ctx->background().stopping()) return;
+        CameraFileInfo info;
+        int ret = ctx->io().run(IO_BACKGROUND, [&] {
+            return ctx->camera().getInfo(path, name, &info);
+        });
+        if (ret != GP_OK) continue;
+
+        OpGuard op(ctx);
+        File *file = ctx->index().findFile(ChildPath(path, name));
+        if (file == nullptr) continue;
+        {
+            lock_guard<mutex> fileGuard(file->lock);
+            if (file->ref > 0 || file->changed || file->infoPending ||
+                    (file->camSize == (off_t)info.file.size &&
+                     file->mtime == info.file.mtime)) {
+                continue;
+            }
+            LOG_DEBUG("refresh: file changed: " + file->path);
+            ctx->diskCache().remove(CacheKey(file->path, file, ctx));
+            DropBlocks(file, ctx);
+            file->download.reset();
+            ForgetPreview(file, ctx);
+            file->xattrsLoaded = false;
+            lock_guard<mutex> attrGuard(file->attrLock);
+            file->size = info.file.size;
+            file->camSize = info.file.size;
+            file->mtime = info.file.mtime;
+            file->xattrs.clear();
+            InfoXattrs(info, &file->xattrs);
+        }
+        InvalidateInode(file->ino);
     }
+}
 
-    unique_lock<mutex> fileGuard(file->lock);
-    if (file->ref > 0) {
-        return -EBUSY;
+/*
+ * Re-lists a listed dir and applies the difference in names to the tree.
+ * Nodes still listed are kept, along with their attributes, open handles
+ * and cached contents. New files are added with their info pending, it is
+ * fetched in the background. With checkFiles, the files already known are
+ * checked for changes too, if the dir is one whose listing comes with file
+ * info. No tree lock is held during camera calls.
+ */
+static int RefreshDir(const string& path, bool checkFiles, Context *ctx) {
+    set<string> folderNames, fileNames;
+    int ret = ListNames(path, true, &folderNames, ctx, IO_BACKGROUND);
+    if (ret != 0) return ret;
+    ret = ListNames(path, false, &fileNames, ctx, IO_BACKGROUND);
+    if (ret != 0) return ret;
+    // as in ListDir()
+    size_t threshold = ctx->options().listThreshold;
+    if (ctx->options().lazyInfo ||
+            (threshold > 0 && fileNames.size() > threshold)) {
+        checkFiles = false;
     }
+    // looked up here, so that it isn't with tree locks held
+    if (ctx->diskCache().enabled()) ctx->deviceId();
+
+    // the kernel is told once the locks are released
+    uint64_t ino;
+    vector<string> stale;
+    vector<string> known;
+    bool added = false;
+    {
+        OpGuard op(ctx);
+        Dir *dir = FindDir(path, ctx);
+        if (dir == nullptr) return -ENOENT;
+        ino = dir->ino;
+        dir->listedAt = Now();
+
+        WriteGuard guard(dir->lock);
+        for (auto it = dir->dirs.begin(); it != dir->dirs.end();) {
+            Dir *subDir = it->second;
+            it++;
+            if (folderNames.erase(subDir->name) > 0 || !UnlinkTree(subDir)) {
+                continue;
+            }
+            LOG_DEBUG("refresh: dir gone: " + subDir->path);
+            stale.push_back(subDir->name);
+            dir->removeDirLocked(subDir);
+            DropFiles(subDir, ctx);
+            ctx->retire(subDir);
+        }
+        for (const string& name : folderNames) {
+            LOG_DEBUG("refresh: new dir: " + ChildPath(path, name));
+            stale.push_back(name);
+            dir->addDirLocked(new Dir(name));
+        }
 
-    int ret = gp_camera_file_delete(ctx->camera(), dirName, fileName,
-            ctx->context());
-    if (ret != GP_OK) {
-        return gpresultToErrno(ret);
+        for (auto it = dir->files.begin(); it != dir->files.end();) {
+            File *file = it->second;
+            it++;
+            if (fileNames.find(file->name) != fileNames.end()) {
+                if (checkFiles) known.push_back(file->name);
+                continue;
+            }
+            {
+                lock_guard<mutex> fileGuard(file->lock);
+                if (file->ref > 0 || file->changed) {
+                    continue;
+                }
+                file->unlinked = true;
+                ctx->diskCache().remove(CacheKey(file->path, file, ctx));
+            }
+            LOG_DEBUG("refresh: file gone: " + file->path);
+            stale.push_back(file->name);
+            dir->removeFileLocked(file);
+            ctx->cache().drop(file);
+            ctx->previews().drop(file);
+            ctx->retire(file);
+        }
+        for (const string& name : fileNames) {
+            if (dir->files.find(name) != dir->files.end()) continue;
+            LOG_DEBUG("refresh: new file: " + ChildPath(path, name));
+            File *file = new File(name, 0, 0);
+            file->infoPending = true;
+            dir->addFileLocked(file);
+            stale.push_back(name);
+            added = true;
+        }
     }
-
-    dir->removeFile(file);
-    fileGuard.unlock();
-    delete file;
+    // new dirs too, they may be cached as missing
+    for (const string& name : stale) {
+        InvalidateEntry(ino, name, ctx);
+    }
+    if (added) {
+        ctx->background().submit([ctx, path] {
+            FetchPendingInfo(path, ctx);
+        });
+    }
+    CheckFiles(path, known, ctx);
     return 0;
 }
 
 /*
- * Dir ops
+ * With -o dir_ttl, queues a refresh of a listing older than the TTL. The old
+ * listing is served until the refresh applies its difference.
  */
+static void RevalidateStale(Dir *dir, Context *ctx) {
+    int ttl = ctx->options().dirTtl;
+    if (ttl == 0 || !dir->listed || Now() - dir->listedAt < ttl) return;
+    if (dir->refreshing.exchange(true)) return;
+    string path = dir->path;
+    ctx->background().submit([ctx, path] {
+        RefreshDir(path, true, ctx);
+        OpGuard op(ctx);
+        Dir *dir = ctx->index().findDir(path);
+        if (dir != nullptr) dir->refreshing = false;
+    });
+}
 
-Dir* FindDir(const string& path, Context *ctx) {
-    Dir* dir = &ctx->root();
-    string dirPath = "/";
-    Debug("finddir: " + path);
-
-    int last;
-    if (path[0] == '/') {
-        last = 0;
-    } else {
-        last = -1;
-    }
-
-    while (true) {
-        int next = path.find('/', last + 1);
-        if (next == string::npos) {
-            string name = path.substr(last + 1);
-            Debug("last child: " + name);
-            if (name == "") {
-                Debug("return self dir: " + dir->name);
-                return dir;
-            }
-            if (!dir->listed) {
-                ListDir(dirPath.c_str(), dir, ctx);
+/*
+ * Runs in the background after a snapshot is loaded, or objects were
+ * removed on the camera, and brings every listed dir up to date with it.
+ * With checkFiles, the info of known files is compared too, in the dirs
+ * whose listing fetches it anyway; see RefreshDir().
+ */
+static void RevalidateTree(bool checkFiles, Context *ctx) {
+    deque<string> queue;
+    queue.push_back("/");
+    while (!queue.empty() && !ctx->background().stopping()) {
+        string path = queue.front();
+        queue.pop_front();
+        if (RefreshDir(path, checkFiles, ctx) != 0) continue;
+
+        OpGuard op(ctx);
+        Dir *dir = FindDir(path, ctx);
+        if (dir == nullptr) continue;
+        ReadGuard guard(dir->lock);
+        for (auto& it : dir->dirs) {
+            if (it.second->listed) {
+                queue.push_back(ChildPath(path, it.first));
             }
-            return dir->getDir(name);
-        }
-        // next != npos: next >= last + 1
-        string name = path.substr(last + 1, next - last - 1);
-        Debug("child: " + name);
-        if (name == "") {
-            last = next;
-            continue;
-        }
-        if (!dir->listed) {
-            ListDir(dirPath.c_str(), dir, ctx);
         }
-        dir = dir->getDir(name);
-        if (dir == nullptr) {
-            return nullptr;
-        }
-        dirPath = dirPath + "/" + name;
-        last = next;
     }
+    LOG_DEBUG("snapshot revalidated");
 }
 
-static int ListDir(const char *path, Dir *dir, Context *ctx) {
-    // XXX: Dir should know its path
+// set while a RevalidateTree() pass is queued and has not started yet
+static atomic<bool> revalidationQueued(false);
 
-    CameraList *list = NULL;
-    gp_list_new(&list);
+/*
+ * Queues a RevalidateTree() pass for removed objects, unless one is already
+ * waiting to start. A pass that is running may have listed a dir before the
+ * change, so one more can be queued behind it. Removals only change names,
+ * so files are not checked.
+ */
+static void QueueRevalidation(Context *ctx) {
+    if (revalidationQueued.exchange(true)) return;
+    ctx->background().submit([ctx] {
+        revalidationQueued = false;
+        RevalidateTree(false, ctx);
+    });
+}
 
-    int ret = gp_camera_folder_list_folders(ctx->camera(),
-            path, list, ctx->context());
-    if (ret != 0) {
-        gp_list_free(list);
-        return gpresultToErrno(ret);
+/*
+ * Fetches the previews of a dir that are not cached yet, so that they are
+ * ready by the time a grid of thumbnails is drawn.
+ */
+static void PrefetchPreviews(const string& path, Context *ctx) {
+    vector<string> names;
+    {
+        OpGuard op(ctx);
+        Dir *dir = FindDir(path, ctx);
+        if (dir == nullptr) return;
+        ReadGuard guard(dir->lock);
+        for (auto& it : dir->files) names.push_back(it.first);
     }
-
-    for (int i = 0; i < gp_list_count(list); i++) {
-        const char *name;
-        gp_list_get_name(list, i, &name);
-        unique_ptr<Dir> subDir(new Dir(name));
-        dir->addDir(subDir.release());
-        Debug(string("child dir : ") + name + " (" + path + ")");
+    for (const string& name : names) {
+        if (ctx->background().stopping()) return;
+        OpGuard op(ctx);
+        File *file = FindFile(ChildPath(path, name), ctx);
+        if (file == nullptr) continue;
+        lock_guard<mutex> fileGuard(file->lock);
+        // not on the camera yet
+        if (file->changed) continue;
+        shared_ptr<Block> preview;
+        GetPreview(file, IO_BACKGROUND, &preview, ctx);
     }
+}
 
-    gp_list_free(list);
-    list = NULL;
-
-    gp_list_new(&list);
+/*
+ * Passes the entries of a listing from offset on to the filler. Entries are
+ * numbered in listing order, so that the kernel can resume after the last
+ * one that fit in its buffer.
+ */
+struct ListingFiller {
+    void *buf;
+    fuse_fill_dir_t filler;
+    off_t offset;
+    off_t count;
+
+    ListingFiller(void *buf, fuse_fill_dir_t filler, off_t offset)
+        : buf(buf), filler(filler), offset(offset), count(0) {}
+
+    // Returns false once the buffer is full.
+    bool add(const char *name, const struct stat *st) {
+        count++;
+        if (count <= offset) return true;
+        return filler(buf, name, st, count) == 0;
+    }
+};
 
-    ret = gp_camera_folder_list_files(ctx->camera(),
-            path, list, ctx->context());
-    if (ret != GP_OK) {
-        gp_list_free(list);
-        return gpresultToErrno(ret);
+static int ReaddirStats(StatsNode node, void *buf, fuse_fill_dir_t filler,
+        off_t offset, Context *ctx) {
+    if (node != STATS_DIR) return node == STATS_MISSING ? -ENOENT : -ENOTDIR;
+    ListingFiller fill(buf, filler, offset);
+    if (!fill.add(".", NULL) || !fill.add("..", NULL)) return 0;
+    for (int i = STATS_TEXT; i <= STATS_JSON; i++) {
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        GetattrStats((StatsNode)i, &st, ctx);
+        if (!fill.add(kStatsFiles[i - STATS_TEXT], &st)) return 0;
     }
+    return 0;
+}
 
-    for (int i = 0; i < gp_list_count(list); i++) {
-        const char *name;
-        CameraFileInfo info;
+static int ReaddirPreview(const string& path, void *buf,
+        fuse_fill_dir_t filler, off_t offset, Context *ctx) {
+    Dir *dir = FindDir(path, ctx);
+    if (dir == nullptr) {
+        return FindFile(path, ctx) != nullptr ? -ENOTDIR : -ENOENT;
+    }
+    int ret = ListDir(dir, ctx);
+    if (ret) return ret;
+    RevalidateStale(dir, ctx);
+    if (offset == 0) {
+        ctx->background().submit([ctx, path] {
+            PrefetchPreviews(path, ctx);
+        });
+    }
 
-        gp_list_get_name(list, i, &name);
-        ret = gp_camera_file_get_info(ctx->camera(), path, name, &info,
-                ctx->context());
-        if (ret != GP_OK) {
-            gp_list_free(list);
-            return gpresultToErrno(ret);
-        }
+    ListingFiller fill(buf, filler, offset);
+    if (!fill.add(".", NULL) || !fill.add("..", NULL)) return 0;
 
-        unique_ptr<File> file(new File(name, info));
-        dir->addFile(file.release());
-        Debug(string("child file: ") + name + " (" + path + ")");
+    ReadGuard guard(dir->lock);
+    for (auto& it : dir->dirs) {
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_ino = PreviewIno(it.second->ino);
+        st.st_mode = S_IFDIR | 0555;
+        if (!fill.add(it.first.c_str(), &st)) return 0;
+    }
+    for (auto& it : dir->files) {
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_ino = PreviewIno(it.second->ino);
+        st.st_mode = S_IFREG | 0444;
+        if (!fill.add(it.first.c_str(), &st)) return 0;
     }
-
-    gp_list_free(list);
-    dir->listed = true;
     return 0;
 }
 
 static int Readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         off_t offset, struct fuse_file_info *fileInfo) {
-    Context *ctx = (Context *)fuse_get_context()->private_data;
-    lock_guard<mutex> guard(ctx->lock());
+    Context *ctx = CurrentContext();
+    OpTimer timer(ctx, STAT_READDIR, path);
+    OpGuard op(ctx);
+    StatsNode stats = StatsPath(path);
+    if (stats != STATS_NONE) {
+        return ReaddirStats(stats, buf, filler, offset, ctx);
+    }
+    string realPath;
+    if (PreviewPath(path, &realPath, ctx)) {
+        return ReaddirPreview(realPath, buf, filler, offset, ctx);
+    }
     Dir *dir = FindDir(path, ctx);
     if (dir == nullptr) {
         return -ENOENT;
     }
-    if (!dir->listed) {
-        int ret = ListDir(path, dir, ctx);
-        if (ret) return ret;
+    int ret = ListDir(dir, ctx);
+    if (ret) return ret;
+    RevalidateStale(dir, ctx);
+    // what is under it is likely to be asked for next
+    ctx->crawler().boost(dir->path);
+
+    ListingFiller fill(buf, filler, offset);
+    if (!fill.add(".", NULL) || !fill.add("..", NULL)) return 0;
+    if (dir == &ctx->root() && ctx->options().previews) {
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_ino = PreviewIno(dir->ino);
+        st.st_mode = S_IFDIR | 0555;
+        if (!fill.add(kPreviewRoot + 1, &st)) return 0;
     }
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
-
+    ReadGuard guard(dir->lock);
     for (auto it = dir->dirs.begin(); it != dir->dirs.end(); it++) {
         Dir *subDir = it->second;
 
         struct stat st;
+        st.st_ino = subDir->ino;
         st.st_mode = S_IFDIR | 0755;
         st.st_nlink = 2;
         st.st_uid = ctx->uid();
         st.st_gid = ctx->gid();
 
-        filler(buf, subDir->name.c_str(), &st, 0);
+        if (!fill.add(subDir->name.c_str(), &st)) return 0;
     }
 
     for (auto it = dir->files.begin(); it != dir->files.end(); it++) {
         File *file = it->second;
 
         struct stat st;
+        st.st_ino = file->ino;
         st.st_mode = S_IFREG | 0644;
         st.st_nlink = 1;
         st.st_uid = ctx->uid();
         st.st_gid = ctx->gid();
-        st.st_size = file->size;
-        st.st_mtime = file->mtime;
-        st.st_blocks = (file->size / 512) +
-            (file->size % 512 > 0 ? 1 : 0);
+        {
+            lock_guard<mutex> attrGuard(file->attrLock);
+            // size and mtime are only known once the info has been fetched
+            st.st_size = file->size;
+            st.st_mtime = file->mtime;
+        }
+        st.st_blocks = (st.st_size / 512) +
+            (st.st_size % 512 > 0 ? 1 : 0);
 
-        filler(buf, file->name.c_str(), &st, 0);
+        if (!fill.add(file->name.c_str(), &st)) return 0;
     }
 
     return 0;
 }
 
 static int Mkdir(const char *path, mode_t mode) {
-    Context *ctx = (Context *)fuse_get_context()->private_data;
-    lock_guard<mutex> guard(ctx->lock());
-    const char *parentName = dirname(path);
-    const char *dirName = basename(path);
+    Context *ctx = CurrentContext();
+    OpTimer timer(ctx, STAT_MKDIR, path);
+    OpGuard op(ctx);
+    string realPath;
+    if (PreviewPath(path, &realPath, ctx)) return -EROFS;
+    if (StatsPath(path) != STATS_NONE) return -EROFS;
+    string parentName = DirName(path);
+    string dirName = BaseName(path);
 
     Dir *parent = FindDir(parentName, ctx);
     if (parent == nullptr) {
         return -ENOENT;
     }
 
-    int ret = gp_camera_folder_make_dir(ctx->camera(), parentName,
-            dirName, ctx->context());
+    int ret = ctx->io().run(IO_META, [&] {
+        return ctx->camera().makeDir(parentName, dirName);
+    });
     if (ret != GP_OK) {
         return gpresultToErrno(ret);
     }
     Dir *dir = new Dir(dirName);
-    parent->addDir(dir);
+    if (!parent->addDir(dir)) delete dir;
     return 0;
 }
 
 static int Rmdir(const char *path) {
-    Context *ctx = (Context *)fuse_get_context()->private_data;
-    lock_guard<mutex> guard(ctx->lock());
-    const char *parentName = dirname(path);
-    const char *dirName = basename(path);
+    Context *ctx = CurrentContext();
+    OpTimer timer(ctx, STAT_RMDIR, path);
+    OpGuard op(ctx);
+    string realPath;
+    if (PreviewPath(path, &realPath, ctx)) return -EROFS;
+    if (StatsPath(path) != STATS_NONE) return -EROFS;
+    string parentName = DirName(path);
+    string dirName = BaseName(path);
 
     Dir *parent = FindDir(parentName, ctx);
     Dir *dir = FindDir(path, ctx);
@@ -507,58 +2227,265 @@ static int Rmdir(const char *path) {
         return -ENOTEMPTY;
     }
 
-    int ret = gp_camera_folder_remove_dir(ctx->camera(), parentName, dirName,
-            ctx->context());
+    int ret = ctx->io().run(IO_META, [&] {
+        return ctx->camera().removeDir(parentName, dirName);
+    });
     if (ret != GP_OK) {
         return gpresultToErrno(ret);
     }
 
     parent->removeDir(dir);
-    delete dir;
+    ctx->retire(dir);
     return 0;
 }
 
 /*
- * Meta functions
+ * Lists a dir for the crawler, at background priority.
+ */
+static int CrawlDir(const string& path, vector<string> *subDirs,
+        Context *ctx) {
+    OpGuard op(ctx);
+    Dir *dir = ctx->index().findDir(path);
+    if (dir == nullptr) return -ENOENT;
+    int ret = ListDir(dir, ctx, IO_BACKGROUND);
+    if (ret != 0) return ret;
+    ReadGuard guard(dir->lock);
+    for (auto& it : dir->dirs) {
+        subDirs->push_back(it.second->path);
+    }
+    return 0;
+}
+
+/*
+ * Camera events
  */
 
-static void* Init(struct fuse_conn_info *conn) {
-    return new Context();
+/*
+ * A dir was made on the camera. Only a listed parent needs to know, others
+ * will see it when they are listed.
+ */
+static void AddedDir(const string& parentPath, const string& name,
+        Context *ctx) {
+    uint64_t ino;
+    {
+        OpGuard op(ctx);
+        Dir *parent = ctx->index().findDir(parentPath);
+        if (parent == nullptr || !parent->listed) return;
+        Dir *dir = new Dir(name);
+        if (!parent->addDir(dir)) {
+            delete dir;
+            return;
+        }
+        LOG_DEBUG("event: new dir: " + dir->path);
+        ino = parent->ino;
+    }
+    InvalidateEntry(ino, name, ctx);
 }
 
-static void Destroy(void *void_context) {
-    Context *context = (Context *)void_context;
-    delete context;
+// A file was stored on the camera, such as a new shot.
+static void AddedFile(const string& dirPath, const string& name,
+        Context *ctx) {
+    {
+        OpGuard op(ctx);
+        Dir *dir = ctx->index().findDir(dirPath);
+        if (dir == nullptr) {
+            // new folder for the shot
+            AddedDir(DirName(dirPath), BaseName(dirPath), ctx);
+            return;
+        }
+        if (!dir->listed || dir->getFile(name) != nullptr) return;
+    }
+
+    CameraFileInfo info;
+    int ret = ctx->io().run(IO_BACKGROUND, [&] {
+        return ctx->camera().getInfo(dirPath, name, &info);
+    });
+    if (ret != GP_OK) return;
+
+    uint64_t ino;
+    {
+        OpGuard op(ctx);
+        Dir *dir = ctx->index().findDir(dirPath);
+        if (dir == nullptr) return;
+        File *file = new File(name, info);
+        if (!dir->addFile(file)) {
+            delete file;
+            return;
+        }
+        LOG_DEBUG("event: new file: " + file->path);
+        ino = dir->ino;
+    }
+    InvalidateEntry(ino, name, ctx);
 }
 
-static int Statfs(const char *path, struct statvfs *stat) {
-    Context *ctx = (Context *)fuse_get_context()->private_data;
+/*
+ * Polls the camera for events while mounted, and applies them to the
+ * listed part of the tree. Cameras report new files and folders with their
+ * path. Removals only come as unknown events with an object handle, which
+ * doesn't tell the dir, so they trigger a pass over the listings of the
+ * listed dirs instead. A burst of removals queues a single pass.
+ */
+static void WatchEvents(Context *ctx) {
+    // short, the camera thread is busy while waiting
+    const int kWaitMs = 20;
+    while (!ctx->events().stopping()) {
+        CameraEventType type;
+        void *data = nullptr;
+        int ret = ctx->io().run(IO_BACKGROUND, [&] {
+            return ctx->camera().waitForEvent(kWaitMs, &type, &data);
+        });
+        if (ret == GP_ERROR_NOT_SUPPORTED) {
+            LOG_WARN("camera does not report events");
+            return;
+        }
+        if (ret == GP_OK && data != nullptr) {
+            if (type == GP_EVENT_FILE_ADDED) {
+                CameraFilePath *added = (CameraFilePath *)data;
+                AddedFile(added->folder, added->name, ctx);
+            } else if (type == GP_EVENT_FOLDER_ADDED) {
+                CameraFilePath *added = (CameraFilePath *)data;
+                AddedDir(added->folder, added->name, ctx);
+            } else if (type == GP_EVENT_UNKNOWN &&
+                    strstr((const char *)data, "ObjectRemoved") != nullptr) {
+                LOG_DEBUG("event: object removed");
+                QueueRevalidation(ctx);
+            }
+        }
+        free(data);
+        if (ret != GP_OK || type == GP_EVENT_TIMEOUT) {
+            usleep(ctx->options().eventInterval * 1000);
+        }
+    }
+}
+
+/*
+ * Meta functions
+ */
+
+/*
+ * Identifies the card in the camera, so that a snapshot is only used for
+ * the same storage it was taken from.
+ */
+static string SnapshotKey(Context *ctx) {
     CameraStorageInformation *storageInfo;
-    int res, numInfo;
+    int numInfo;
+    int ret = ctx->io().run(IO_META, [&] {
+        return ctx->camera().storageInfo(&storageInfo, &numInfo);
+    });
+    if (ret != GP_OK) {
+        return "";
+    }
+    string key = ctx->deviceId();
+    for (int i = 0; i < numInfo; i++) {
+        key += string("|") + storageInfo[i].basedir + "|" +
+            storageInfo[i].label + "|" +
+            to_string(storageInfo[i].capacitykbytes);
+    }
+    free(storageInfo);
+    return key;
+}
 
-    res = gp_camera_get_storageinfo(ctx->camera(),
-            &storageInfo, &numInfo, ctx->context());
-    if (res != GP_OK) {
-        if (ctx->statCache()) {
-            *stat = *ctx->statCache();
-            return 0;
+static string SnapshotPath(Context *ctx) {
+    return ctx->diskCache().dir() + "/snapshot-" +
+        HashString(ctx->snapshotKey());
+}
+
+static Context *Mount(const Options& options) {
+    // the daemon has forked by now, so the writer thread is ours
+    StartAsyncLog();
+    if (options.trace) {
+        StartTracing(options.trace, options.traceSize);
+    }
+    Context *ctx = new Context(options);
+    mounted = ctx;
+    if (options.writeback) {
+        ctx->uploads().start([ctx](File *file, bool last) {
+            return UploadQueued(file, last, ctx);
+        });
+    }
+
+    if (ctx->diskCache().enabled()) {
+        ctx->setSnapshotKey(SnapshotKey(ctx));
+        if (!ctx->snapshotKey().empty() &&
+                LoadSnapshot(SnapshotPath(ctx), ctx->snapshotKey(),
+                    ctx->root())) {
+            ctx->background().submit([ctx] { RevalidateTree(true, ctx); });
         }
-        return gpresultToErrno(res);
     }
-    if (numInfo == 0) {
-        Warn("num of storage = 0");
-        return -EINVAL;
+    if (options.events) {
+        ctx->events().submit([ctx] { WatchEvents(ctx); });
     }
-    if (numInfo == 1) {
-        stat->f_bsize = 1024;
-        stat->f_frsize = 1024;
-        stat->f_blocks = storageInfo->capacitykbytes;
-        stat->f_bfree = storageInfo->freekbytes;
-        stat->f_bavail = storageInfo->freekbytes;
-        stat->f_files = -1;
-        stat->f_ffree = -1;
+    if (options.crawl) {
+        ctx->crawler().start([ctx](const string& path,
+                    vector<string> *subDirs) {
+            return CrawlDir(path, subDirs, ctx);
+        }, options.crawlDepth, options.crawlTime);
+    }
+    return ctx;
+}
+
+static void* Init(struct fuse_conn_info *conn) {
+    conn->want |= conn->capable & FUSE_CAP_ATOMIC_O_TRUNC;
+    return Mount(*(Options *)fuse_get_context()->private_data);
+}
+
+static void Destroy(void *void_context) {
+    Context *ctx = (Context *)void_context;
+    ctx->crawler().stop();
+    ctx->events().stop();
+    ctx->uploads().stop();
+    ctx->readahead().stop();
+    ctx->prefetch().stop();
+    ctx->background().stop();
+    UploadDirty(&ctx->root(), ctx);
+    if (!ctx->snapshotKey().empty()) {
+        SaveSnapshot(SnapshotPath(ctx), ctx->snapshotKey(), ctx->root());
     }
-    ctx->cacheStat(stat);
+    mounted = nullptr;
+    delete ctx;
+    StopTracing();
+    StopAsyncLog();
+}
+
+static int Statfs(const char *path, struct statvfs *stat) {
+    Context *ctx = CurrentContext();
+    OpTimer timer(ctx, STAT_STATFS, path);
+    // The stat cache is only touched from the camera thread.
+    int ret = ctx->io().run(IO_META, [&] {
+        CameraStorageInformation *storageInfo;
+        int numInfo;
+        int res = ctx->camera().storageInfo(&storageInfo, &numInfo);
+        if (res != GP_OK) {
+            if (ctx->statCache()) {
+                *stat = *ctx->statCache();
+                return 0;
+            }
+            return gpresultToErrno(res);
+        }
+        if (numInfo == 0) {
+            LOG_WARN("num of storage = 0");
+            free(storageInfo);
+            return -EINVAL;
+        }
+        if (numInfo == 1) {
+            stat->f_bsize = 1024;
+            stat->f_frsize = 1024;
+            stat->f_blocks = storageInfo->capacitykbytes;
+            stat->f_bfree = storageInfo->freekbytes;
+            stat->f_bavail = storageInfo->freekbytes;
+            stat->f_files = -1;
+            stat->f_ffree = -1;
+        }
+        free(storageInfo);
+        ctx->cacheStat(stat);
+        return 0;
+    });
+    if (ret != 0) return ret;
+
+    // Space the queued uploads are going to take, in f_frsize units.
+    fsblkcnt_t pending = (ctx->uploads().pendingBytes() + 1023) / 1024;
+    stat->f_bfree = stat->f_bfree > pending ? stat->f_bfree - pending : 0;
+    stat->f_bavail = stat->f_bavail > pending ? stat->f_bavail - pending : 0;
     return 0;
 }
 
@@ -582,6 +2509,7 @@ static fuse_operations GPhotoFS2_Operations = {
     .chown = Chown,
     .chmod = Chmod,
     .truncate = Truncate,
+    .ftruncate = Ftruncate,
 
     .getattr = Getattr,
 
@@ -596,9 +2524,465 @@ static fuse_operations GPhotoFS2_Operations = {
     .read = Read,
     .write = Write,
     .flush = Flush,
+    .fsync = Fsync,
+
+    .getxattr = Getxattr,
+    .listxattr = Listxattr,
+};
+
+/*
+ * Low-level backend
+ *
+ * The kernel knows nodes by inode number, and caches names and attributes
+ * for the configured timeouts. Inodes are resolved to paths, and the ops
+ * above do the work.
+ */
+
+// A page of a listing, as much as fits in the size the kernel asked for.
+struct DirListing {
+    fuse_req_t req;
+    size_t size;
+    vector<char> data;
+};
+
+static int InodePath(fuse_ino_t ino, string *path) {
+    if (!CurrentContext()->inodes().path(ino, path)) {
+        return -ESTALE;
+    }
+    return 0;
+}
+
+/*
+ * Fills in the entry of a node for the kernel and counts the lookup.
+ */
+static int MakeEntry(const string& path, struct fuse_entry_param *entry) {
+    Context *ctx = CurrentContext();
+    memset(entry, 0, sizeof(*entry));
+    int ret = Getattr(path.c_str(), &entry->attr);
+    if (ret != 0) return ret;
+    entry->ino = entry->attr.st_ino;
+    entry->attr_timeout = ctx->options().attrTimeout;
+    entry->entry_timeout = ctx->options().entryTimeout;
+    ctx->inodes().remember(entry->ino, path);
+    return 0;
+}
+
+static int FillListing(void *buf, const char *name, const struct stat *st,
+        off_t offset) {
+    DirListing *listing = (DirListing *)buf;
+    struct stat dirStat;
+    if (st == nullptr) {
+        memset(&dirStat, 0, sizeof(dirStat));
+        dirStat.st_mode = S_IFDIR;
+        st = &dirStat;
+    }
+    size_t pos = listing->data.size();
+    size_t len = fuse_add_direntry(listing->req, nullptr, 0, name, nullptr, 0);
+    if (pos + len > listing->size) return 1;
+    listing->data.resize(pos + len);
+    fuse_add_direntry(listing->req, &listing->data[pos], len, name, st,
+            offset);
+    return 0;
+}
+
+static void LowInit(void *userdata, struct fuse_conn_info *conn) {
+    conn->want |= conn->capable & FUSE_CAP_ATOMIC_O_TRUNC;
+    Mount(*(Options *)userdata);
+}
+
+static void LowDestroy(void *userdata) {
+    Destroy(CurrentContext());
+}
+
+static void LowLookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    Context *ctx = CurrentContext();
+    string parentPath;
+    int ret = InodePath(parent, &parentPath);
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    struct fuse_entry_param entry;
+    ret = MakeEntry(ChildPath(parentPath, name), &entry);
+    if (ret == -ENOENT && ctx->options().negativeTimeout > 0) {
+        // an entry with inode 0 is cached as a miss
+        memset(&entry, 0, sizeof(entry));
+        entry.entry_timeout = ctx->options().negativeTimeout;
+        ret = 0;
+    }
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fuse_reply_entry(req, &entry);
+}
+
+static void LowForget(fuse_req_t req, fuse_ino_t ino, unsigned long lookups) {
+    CurrentContext()->inodes().forget(ino, lookups);
+    fuse_reply_none(req);
+}
+
+static void LowGetattr(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *fileInfo) {
+    string path;
+    int ret = InodePath(ino, &path);
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    if (ret == 0) ret = Getattr(path.c_str(), &st);
+    // the path now leads to another node
+    if (ret == 0 && st.st_ino != ino) ret = -ESTALE;
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fuse_reply_attr(req, &st, CurrentContext()->options().attrTimeout);
+}
+
+static void LowSetattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+        int toSet, struct fuse_file_info *fileInfo) {
+    string path;
+    int ret = InodePath(ino, &path);
+    if (ret == 0 && (toSet & FUSE_SET_ATTR_SIZE)) {
+        if (fileInfo != nullptr) {
+            ret = Ftruncate(path.c_str(), attr->st_size, fileInfo);
+        } else {
+            ret = Truncate(path.c_str(), attr->st_size);
+        }
+    }
+    // Mode, owner and times are ignored, as in Chmod() and Chown().
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    LowGetattr(req, ino, fileInfo);
+}
+
+static void LowMkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+        mode_t mode) {
+    string path;
+    int ret = InodePath(parent, &path);
+    path = ChildPath(path, name);
+    if (ret == 0) ret = Mkdir(path.c_str(), mode);
+    struct fuse_entry_param entry;
+    if (ret == 0) ret = MakeEntry(path, &entry);
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fuse_reply_entry(req, &entry);
+}
+
+static void LowUnlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    string path;
+    int ret = InodePath(parent, &path);
+    if (ret == 0) ret = Unlink(ChildPath(path, name).c_str());
+    fuse_reply_err(req, -ret);
+}
+
+static void LowRmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    string path;
+    int ret = InodePath(parent, &path);
+    if (ret == 0) ret = Rmdir(ChildPath(path, name).c_str());
+    fuse_reply_err(req, -ret);
+}
+
+static void LowCreate(fuse_req_t req, fuse_ino_t parent, const char *name,
+        mode_t mode, struct fuse_file_info *fileInfo) {
+    string path;
+    int ret = InodePath(parent, &path);
+    path = ChildPath(path, name);
+    if (ret == 0) ret = Create(path.c_str(), mode, fileInfo);
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    struct fuse_entry_param entry;
+    ret = MakeEntry(path, &entry);
+    if (ret != 0) {
+        Release(path.c_str(), fileInfo);
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fuse_reply_create(req, &entry, fileInfo);
+}
+
+static void LowOpen(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *fileInfo) {
+    string path;
+    int ret = InodePath(ino, &path);
+    if (ret == 0) ret = Open(path.c_str(), fileInfo);
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fuse_reply_open(req, fileInfo);
+}
+
+static void LowRead(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+        struct fuse_file_info *fileInfo) {
+    // kept by each thread, reads are at most max_read bytes
+    static thread_local vector<char> buf;
+    string path;
+    int ret = InodePath(ino, &path);
+    if (buf.size() < size) buf.resize(size);
+    if (ret == 0) ret = Read(path.c_str(), buf.data(), size, offset, fileInfo);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fuse_reply_buf(req, buf.data(), ret);
+}
+
+static void LowWrite(fuse_req_t req, fuse_ino_t ino, const char *buf,
+        size_t size, off_t offset, struct fuse_file_info *fileInfo) {
+    string path;
+    int ret = InodePath(ino, &path);
+    if (ret == 0) ret = Write(path.c_str(), buf, size, offset, fileInfo);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fuse_reply_write(req, ret);
+}
+
+static void LowFlush(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *fileInfo) {
+    string path;
+    int ret = InodePath(ino, &path);
+    if (ret == 0) ret = Flush(path.c_str(), fileInfo);
+    fuse_reply_err(req, -ret);
+}
+
+static void LowFsync(fuse_req_t req, fuse_ino_t ino, int dataSync,
+        struct fuse_file_info *fileInfo) {
+    string path;
+    int ret = InodePath(ino, &path);
+    if (ret == 0) ret = Fsync(path.c_str(), dataSync, fileInfo);
+    fuse_reply_err(req, -ret);
+}
+
+static void LowGetxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+        size_t size) {
+    string path;
+    int ret = InodePath(ino, &path);
+    vector<char> buf(size);
+    if (ret == 0) ret = Getxattr(path.c_str(), name, buf.data(), size);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+    } else if (size == 0) {
+        fuse_reply_xattr(req, ret);
+    } else {
+        fuse_reply_buf(req, buf.data(), ret);
+    }
+}
+
+static void LowListxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+    string path;
+    int ret = InodePath(ino, &path);
+    vector<char> buf(size);
+    if (ret == 0) ret = Listxattr(path.c_str(), buf.data(), size);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+    } else if (size == 0) {
+        fuse_reply_xattr(req, ret);
+    } else {
+        fuse_reply_buf(req, buf.data(), ret);
+    }
+}
+
+static void LowRelease(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *fileInfo) {
+    string path;
+    // The kernel keeps the inode while the file is open.
+    InodePath(ino, &path);
+    fuse_reply_err(req, -Release(path.c_str(), fileInfo));
+}
+
+static void LowOpendir(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *fileInfo) {
+    string path;
+    struct stat st;
+    int ret = InodePath(ino, &path);
+    if (ret == 0) ret = Getattr(path.c_str(), &st);
+    if (ret == 0 && !S_ISDIR(st.st_mode)) ret = -ENOTDIR;
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fuse_reply_open(req, fileInfo);
+}
+
+/*
+ * Each call lists one page from offset on. libfuse 2 has no readdirplus, so
+ * entries carry the inode number and type only, and the kernel looks them
+ * up afterwards; with entry_timeout those lookups are answered from its
+ * cache after the first one.
+ */
+static void LowReaddir(fuse_req_t req, fuse_ino_t ino, size_t size,
+        off_t offset, struct fuse_file_info *fileInfo) {
+    DirListing listing;
+    listing.req = req;
+    listing.size = size;
+    string path;
+    int ret = InodePath(ino, &path);
+    if (ret == 0) {
+        ret = Readdir(path.c_str(), &listing, FillListing, offset, fileInfo);
+    }
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fuse_reply_buf(req, listing.data.data(), listing.data.size());
+}
+
+static void LowReleasedir(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *fileInfo) {
+    fuse_reply_err(req, 0);
+}
+
+static void LowStatfs(fuse_req_t req, fuse_ino_t ino) {
+    struct statvfs stat;
+    memset(&stat, 0, sizeof(stat));
+    int ret = Statfs("/", &stat);
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fuse_reply_statfs(req, &stat);
+}
+
+static fuse_lowlevel_ops GPhotoFS2_LowLevelOperations = {
+    .init = LowInit,
+    .destroy = LowDestroy,
+    .statfs = LowStatfs,
+
+    .lookup = LowLookup,
+    .forget = LowForget,
+    .getattr = LowGetattr,
+    .setattr = LowSetattr,
+
+    .opendir = LowOpendir,
+    .readdir = LowReaddir,
+    .releasedir = LowReleasedir,
+    .mkdir = LowMkdir,
+    .rmdir = LowRmdir,
+
+    .create = LowCreate,
+    .open = LowOpen,
+    .release = LowRelease,
+    .unlink = LowUnlink,
+    .read = LowRead,
+    .write = LowWrite,
+    .flush = LowFlush,
+    .fsync = LowFsync,
+
+    .getxattr = LowGetxattr,
+    .listxattr = LowListxattr,
+};
+
+static int LowLevelMain(struct fuse_args *args, Options *options) {
+    char *mountpoint;
+    int multithreaded, foreground;
+    if (fuse_parse_cmdline(args, &mountpoint, &multithreaded,
+                &foreground) == -1) {
+        return 1;
+    }
+    int ret = -1;
+    struct fuse_chan *chan = fuse_mount(mountpoint, args);
+    if (chan != nullptr) {
+        struct fuse_session *session = fuse_lowlevel_new(args,
+                &GPhotoFS2_LowLevelOperations,
+                sizeof(GPhotoFS2_LowLevelOperations), options);
+        if (session != nullptr) {
+            if (fuse_set_signal_handlers(session) != -1) {
+                fuse_session_add_chan(session, chan);
+                fuse_daemonize(foreground);
+                channel = chan;
+                if (multithreaded) {
+                    ret = fuse_session_loop_mt(session);
+                } else {
+                    ret = fuse_session_loop(session);
+                }
+                channel = nullptr;
+                fuse_remove_signal_handlers(session);
+                fuse_session_remove_chan(chan);
+            }
+            fuse_session_destroy(session);
+        }
+        fuse_unmount(mountpoint, chan);
+    }
+    free(mountpoint);
+    return ret == 0 ? 0 : 1;
+}
+
+#define GPHOTOFS2_OPT(t, p) { t, offsetof(Options, p), 0 }
+#define GPHOTOFS2_FLAG(t, p) { t, offsetof(Options, p), 1 }
+
+static struct fuse_opt GPhotoFS2_Options[] = {
+    GPHOTOFS2_OPT("cache_size=%lu", cacheSize),
+    GPHOTOFS2_OPT("cache_dir=%s", cacheDir),
+    GPHOTOFS2_OPT("disk_cache_size=%lu", diskCacheSize),
+    GPHOTOFS2_OPT("spill_size=%lu", spillSize),
+    GPHOTOFS2_FLAG("writeback", writeback),
+    GPHOTOFS2_OPT("writeback_depth=%lu", writebackDepth),
+    GPHOTOFS2_OPT("readahead=%lu", readahead),
+    GPHOTOFS2_OPT("prefetch_files=%lu", prefetchFiles),
+    GPHOTOFS2_OPT("prefetch_size=%lu", prefetchSize),
+    GPHOTOFS2_OPT("dir_ttl=%lu", dirTtl),
+    GPHOTOFS2_FLAG("crawl", crawl),
+    GPHOTOFS2_OPT("crawl_depth=%lu", crawlDepth),
+    GPHOTOFS2_OPT("crawl_time=%lu", crawlTime),
+    GPHOTOFS2_FLAG("events", events),
+    GPHOTOFS2_OPT("event_interval=%lu", eventInterval),
+    GPHOTOFS2_FLAG("simulate", simulate),
+    GPHOTOFS2_OPT("sim_folders=%lu", simFolders),
+    GPHOTOFS2_OPT("sim_files=%lu", simFiles),
+    GPHOTOFS2_OPT("sim_file_size=%lu", simFileSize),
+    GPHOTOFS2_OPT("sim_latency=%lu", simLatency),
+    GPHOTOFS2_OPT("sim_bandwidth=%lu", simBandwidth),
+    GPHOTOFS2_FLAG("previews", previews),
+    GPHOTOFS2_OPT("preview_cache_size=%lu", previewCacheSize),
+    GPHOTOFS2_FLAG("lazy_info", lazyInfo),
+    GPHOTOFS2_OPT("list_threshold=%lu", listThreshold),
+    GPHOTOFS2_OPT("trace=%s", trace),
+    GPHOTOFS2_OPT("trace_size=%lu", traceSize),
+    GPHOTOFS2_OPT("loglevel=%s", logLevel),
+    GPHOTOFS2_FLAG("lowlevel", lowLevel),
+    GPHOTOFS2_OPT("entry_timeout=%lf", entryTimeout),
+    GPHOTOFS2_OPT("attr_timeout=%lf", attrTimeout),
+    GPHOTOFS2_OPT("negative_timeout=%lf", negativeTimeout),
+    FUSE_OPT_END
 };
 
 int main(int argc, char **argv) {
     setlocale (LC_CTYPE,"en_US.UTF-8"); /* for ptp2 driver to convert to utf-8 */
-    return fuse_main(argc, argv, &GPhotoFS2_Operations, NULL);
+
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    Options options;
+    if (fuse_opt_parse(&args, &options, GPhotoFS2_Options, NULL) == -1) {
+        return 1;
+    }
+    if (options.logLevel) {
+        LogLevel level;
+        if (!ParseLogLevel(options.logLevel, &level)) {
+            LOG_ERROR(string("unknown log level: ") + options.logLevel);
+            return 1;
+        }
+        logLevel = level;
+    }
+    int ret;
+    if (options.lowLevel) {
+        ret = LowLevelMain(&args, &options);
+    } else {
+        // The timeouts were taken out of args, pass them on to libfuse.
+        string timeouts = "-oentry_timeout=" +
+            to_string(options.entryTimeout) + ",attr_timeout=" +
+            to_string(options.attrTimeout) + ",negative_timeout=" +
+            to_string(options.negativeTimeout);
+        fuse_opt_add_arg(&args, timeouts.c_str());
+        ret = fuse_main(args.argc, args.argv, &GPhotoFS2_Operations,
+                &options);
+    }
+    fuse_opt_free_args(&args);
+    return ret;
 }
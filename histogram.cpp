@@ -0,0 +1,42 @@
+#include "histogram.h"
+
+#include <algorithm>
+
+using namespace std;
+
+Histogram::Histogram() {
+    reset();
+}
+
+void Histogram::add(uint64_t us) {
+    // bucket i holds [2^(i-1), 2^i), bucket 0 holds 0
+    int bucket = 0;
+    while (bucket < kBuckets - 1 && (us >> bucket) > 0) bucket++;
+    buckets_[bucket]++;
+    count_++;
+    total_ += us;
+    uint64_t longest = max_;
+    while (us > longest && !max_.compare_exchange_weak(longest, us)) {}
+}
+
+void Histogram::reset() {
+    for (auto& bucket : buckets_) bucket = 0;
+    count_ = 0;
+    total_ = 0;
+    max_ = 0;
+}
+
+uint64_t Histogram::percentile(double p) {
+    uint64_t count = count_;
+    if (count == 0) return 0;
+    uint64_t rank = (uint64_t)(count * p / 100);
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; i++) {
+        seen += buckets_[i];
+        if (seen > rank) {
+            uint64_t bound = i == 0 ? 0 : ((uint64_t)1 << i) - 1;
+            return min(bound, (uint64_t)max_);
+        }
+    }
+    return max_;
+}
@@ -0,0 +1,42 @@
+#ifndef __GPHOTOFS2_HISTOGRAM_H_
+#define __GPHOTOFS2_HISTOGRAM_H_
+
+#include <atomic>
+#include <cstdint>
+
+#include "utils.h"
+
+// Counts of durations in power of two buckets of microseconds.
+class Histogram {
+public:
+    static const int kBuckets = 40;
+
+    Histogram();
+    void add(uint64_t us);
+    void reset();
+    uint64_t count() { return count_; }
+    uint64_t total() { return total_; }
+    uint64_t max() { return max_; }
+    // Upper bound of the bucket holding the p-th percentile.
+    uint64_t percentile(double p);
+
+private:
+    std::atomic<uint64_t> buckets_[kBuckets];
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> total_;
+    std::atomic<uint64_t> max_;
+};
+
+// Adds the time from construction to destruction to a histogram.
+class StatTimer {
+public:
+    explicit StatTimer(Histogram& histogram)
+        : histogram_(histogram), start_(MonotonicUs()) {}
+    ~StatTimer() { histogram_.add(MonotonicUs() - start_); }
+
+private:
+    Histogram& histogram_;
+    uint64_t start_;
+};
+
+#endif // __GPHOTOFS2_HISTOGRAM_H_
@@ -0,0 +1,50 @@
+#include "index.h"
+#include "dir.h"
+#include "file.h"
+
+#include <mutex>
+
+using namespace std;
+
+typedef lock_guard<shared_timed_mutex> WriteGuard;
+typedef shared_lock<shared_timed_mutex> ReadGuard;
+
+void PathIndex::add(Dir *dir) {
+    WriteGuard guard(lock_);
+    dirs_[dir->path] = dir;
+}
+
+void PathIndex::add(File *file) {
+    WriteGuard guard(lock_);
+    files_[file->path] = file;
+}
+
+void PathIndex::remove(Dir *dir) {
+    WriteGuard guard(lock_);
+    auto it = dirs_.find(dir->path);
+    if (it != dirs_.end() && it->second == dir) {
+        dirs_.erase(it);
+    }
+}
+
+void PathIndex::remove(File *file) {
+    WriteGuard guard(lock_);
+    auto it = files_.find(file->path);
+    if (it != files_.end() && it->second == file) {
+        files_.erase(it);
+    }
+}
+
+Dir* PathIndex::findDir(const string& path) {
+    ReadGuard guard(lock_);
+    auto it = dirs_.find(path);
+    if (it == dirs_.end()) return nullptr;
+    return it->second;
+}
+
+File* PathIndex::findFile(const string& path) {
+    ReadGuard guard(lock_);
+    auto it = files_.find(path);
+    if (it == files_.end()) return nullptr;
+    return it->second;
+}
@@ -0,0 +1,31 @@
+#ifndef __GPHOTOFS2_INDEX_H_
+#define __GPHOTOFS2_INDEX_H_
+
+#include <string>
+#include <unordered_map>
+
+#include <shared_mutex>
+
+struct Dir;
+struct File;
+
+// Nodes in the tree by full path, so that a path is resolved with one
+// probe. Kept up to date by Dir when children are added and removed.
+class PathIndex {
+public:
+    void add(Dir *dir);
+    void add(File *file);
+    // Only removes the entry if it is still the same node.
+    void remove(Dir *dir);
+    void remove(File *file);
+
+    Dir* findDir(const std::string& path);
+    File* findFile(const std::string& path);
+
+private:
+    std::shared_timed_mutex lock_;
+    std::unordered_map<std::string, Dir*> dirs_;
+    std::unordered_map<std::string, File*> files_;
+};
+
+#endif // __GPHOTOFS2_INDEX_H_
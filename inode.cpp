@@ -0,0 +1,40 @@
+#include "inode.h"
+
+using namespace std;
+
+// FUSE_ROOT_ID, the kernel never looks it up nor forgets it
+static const uint64_t kRootIno = 1;
+
+InodeTable::InodeTable() {
+    entries_[kRootIno] = Entry{"/", 1};
+}
+
+void InodeTable::remember(uint64_t ino, const string& path) {
+    lock_guard<mutex> guard(lock_);
+    auto it = entries_.find(ino);
+    if (it == entries_.end()) {
+        entries_[ino] = Entry{path, 1};
+    } else {
+        it->second.lookups++;
+    }
+}
+
+void InodeTable::forget(uint64_t ino, uint64_t lookups) {
+    if (ino == kRootIno) return;
+    lock_guard<mutex> guard(lock_);
+    auto it = entries_.find(ino);
+    if (it == entries_.end()) return;
+    if (it->second.lookups <= lookups) {
+        entries_.erase(it);
+    } else {
+        it->second.lookups -= lookups;
+    }
+}
+
+bool InodeTable::path(uint64_t ino, string *path) {
+    lock_guard<mutex> guard(lock_);
+    auto it = entries_.find(ino);
+    if (it == entries_.end()) return false;
+    *path = it->second.path;
+    return true;
+}
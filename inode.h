@@ -0,0 +1,31 @@
+#ifndef __GPHOTOFS2_INODE_H_
+#define __GPHOTOFS2_INODE_H_
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Inode numbers the kernel holds, for the low-level backend. Each one is
+// remembered with the path of its node until the kernel forgets it.
+class InodeTable {
+public:
+    InodeTable();
+
+    // Counts one lookup of ino, as done by every reply carrying an entry.
+    void remember(uint64_t ino, const std::string& path);
+    void forget(uint64_t ino, uint64_t lookups);
+    // Returns false if the kernel is not supposed to know ino.
+    bool path(uint64_t ino, std::string *path);
+
+private:
+    struct Entry {
+        std::string path;
+        uint64_t lookups;
+    };
+
+    std::mutex lock_;
+    std::unordered_map<uint64_t, Entry> entries_;
+};
+
+#endif // __GPHOTOFS2_INODE_H_
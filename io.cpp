@@ -0,0 +1,86 @@
+#include "io.h"
+
+using namespace std;
+
+IoScheduler::IoScheduler(Histogram *waits) : waits_(waits), stop_(false) {
+    thread_ = thread(&IoScheduler::loop, this);
+}
+
+IoScheduler::~IoScheduler() {
+    stop();
+}
+
+future<int> IoScheduler::submit(IoPriority priority, function<int()> fn) {
+    packaged_task<int()> task(fn);
+    future<int> result = task.get_future();
+    unique_lock<mutex> guard(lock_);
+    if (stop_) {
+        // Nobody is left to serve it, so don't make the caller hang.
+        guard.unlock();
+        task();
+        return result;
+    }
+    queues_[priority].push_back(Request{move(task), MonotonicUs()});
+    cond_.notify_one();
+    return result;
+}
+
+int IoScheduler::run(IoPriority priority, function<int()> fn) {
+    // A request running on the camera thread can't wait for another one.
+    if (this_thread::get_id() == thread_.get_id()) {
+        return fn();
+    }
+    return submit(priority, fn).get();
+}
+
+void IoScheduler::stop() {
+    {
+        lock_guard<mutex> guard(lock_);
+        stop_ = true;
+        cond_.notify_one();
+    }
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+size_t IoScheduler::queued(IoPriority priority) {
+    lock_guard<mutex> guard(lock_);
+    return queues_[priority].size();
+}
+
+size_t IoScheduler::queued() {
+    lock_guard<mutex> guard(lock_);
+    size_t count = 0;
+    for (auto& queue : queues_) {
+        count += queue.size();
+    }
+    return count;
+}
+
+void IoScheduler::loop() {
+    while (true) {
+        packaged_task<int()> task;
+        {
+            unique_lock<mutex> guard(lock_);
+            int priority = -1;
+            cond_.wait(guard, [this, &priority] {
+                for (int i = 0; i < IO_NUM_PRIORITIES; i++) {
+                    if (!queues_[i].empty()) {
+                        priority = i;
+                        return true;
+                    }
+                }
+                return stop_;
+            });
+            if (priority < 0) return;
+            Request& request = queues_[priority].front();
+            task = move(request.task);
+            if (waits_ != nullptr) {
+                waits_[priority].add(MonotonicUs() - request.queuedAt);
+            }
+            queues_[priority].pop_front();
+        }
+        task();
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef __GPHOTOFS2_IO_H_
+#define __GPHOTOFS2_IO_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+
+#include "histogram.h"
+
+// Classes of camera requests, earlier ones are served first.
+enum IoPriority {
+    // listings, file info, and other metadata
+    IO_META = 0,
+    // contents someone is waiting for
+    IO_READ,
+    // prefetch, uploads, and background metadata
+    IO_BACKGROUND,
+    IO_NUM_PRIORITIES
+};
+
+// Owns the camera: libgphoto2 calls are made from a single thread, in
+// priority order. Large transfers should be split into several requests,
+// so that more urgent ones can get in between.
+class IoScheduler {
+public:
+    // waits, if given, gets the time requests spend queued, by priority
+    explicit IoScheduler(Histogram *waits = nullptr);
+    ~IoScheduler();
+
+    std::future<int> submit(IoPriority priority, std::function<int()> fn);
+    // Runs fn on the camera thread and waits for its result.
+    int run(IoPriority priority, std::function<int()> fn);
+    // Runs what is already queued and stops the thread.
+    void stop();
+    size_t queued();
+    size_t queued(IoPriority priority);
+
+private:
+    struct Request {
+        std::packaged_task<int()> task;
+        uint64_t queuedAt;
+    };
+
+    void loop();
+
+    Histogram *waits_;
+    std::mutex lock_;
+    std::condition_variable cond_;
+    std::deque<Request> queues_[IO_NUM_PRIORITIES];
+    bool stop_;
+    std::thread thread_;
+};
+
+#endif // __GPHOTOFS2_IO_H_
@@ -0,0 +1,122 @@
+#include "log.h"
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+atomic<int> logLevel(LEVEL_WARN);
+
+static const char *kLevelNames[] = { "error", "warn", "info", "debug" };
+static const char *kPrefixes[] = { "ERR: ", "WARN: ", "INFO: ", "DBG: " };
+// messages waiting to be written, beyond that they are dropped
+static const size_t kQueueSize = 4096;
+
+struct LogMessage {
+    LogLevel level;
+    string text;
+};
+
+static mutex queueLock;
+static condition_variable queueCond;
+// a ring of kQueueSize messages, empty while writing directly
+static vector<LogMessage> queue;
+static size_t queueHead = 0;
+static size_t queued = 0;
+static size_t dropped = 0;
+static bool stopping = false;
+static thread writer;
+
+static void WriteMessage(LogLevel level, const string& msg) {
+    string line = kPrefixes[level] + msg + "\n";
+    fwrite(line.data(), 1, line.size(), stderr);
+}
+
+// Writes out the queue in batches, without holding the lock while writing.
+static void WriteQueued() {
+    unique_lock<mutex> guard(queueLock);
+    while (true) {
+        queueCond.wait(guard, [] { return queued > 0 || dropped > 0 ||
+                stopping; });
+        vector<LogMessage> batch;
+        batch.reserve(queued);
+        for (; queued > 0; queued--) {
+            batch.push_back(move(queue[queueHead]));
+            queueHead = (queueHead + 1) % queue.size();
+        }
+        size_t lost = dropped;
+        dropped = 0;
+        bool done = stopping;
+        guard.unlock();
+
+        for (const LogMessage& message : batch) {
+            WriteMessage(message.level, message.text);
+        }
+        if (lost > 0) {
+            WriteMessage(LEVEL_WARN, to_string(lost) +
+                    " log messages dropped");
+        }
+        fflush(stderr);
+        if (done) return;
+        guard.lock();
+    }
+}
+
+void LogWrite(LogLevel level, const string& msg) {
+    {
+        lock_guard<mutex> guard(queueLock);
+        if (!queue.empty()) {
+            if (queued == queue.size()) {
+                dropped++;
+            } else {
+                LogMessage& slot = queue[(queueHead + queued) % queue.size()];
+                slot.level = level;
+                slot.text = msg;
+                queued++;
+            }
+            queueCond.notify_one();
+            return;
+        }
+    }
+    WriteMessage(level, msg);
+}
+
+bool ParseLogLevel(const char *name, LogLevel *level) {
+    for (int i = LEVEL_ERROR; i <= LEVEL_DEBUG; i++) {
+        if (strcmp(name, kLevelNames[i]) == 0) {
+            *level = (LogLevel)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void StartAsyncLog() {
+    lock_guard<mutex> guard(queueLock);
+    if (!queue.empty()) return;
+    queue.resize(kQueueSize);
+    stopping = false;
+    writer = thread(WriteQueued);
+}
+
+void StopAsyncLog() {
+    {
+        lock_guard<mutex> guard(queueLock);
+        if (queue.empty()) return;
+        stopping = true;
+        queueCond.notify_one();
+    }
+    writer.join();
+    // queued after the writer's last batch
+    lock_guard<mutex> guard(queueLock);
+    for (; queued > 0; queued--) {
+        WriteMessage(queue[queueHead].level, queue[queueHead].text);
+        queueHead = (queueHead + 1) % queue.size();
+    }
+    queue.clear();
+    queueHead = 0;
+}
@@ -0,0 +1,39 @@
+#ifndef __GPHOTOFS2_LOG_H_
+#define __GPHOTOFS2_LOG_H_
+
+#include <atomic>
+#include <string>
+
+enum LogLevel {
+    LEVEL_ERROR = 0,
+    LEVEL_WARN,
+    LEVEL_INFO,
+    LEVEL_DEBUG,
+};
+
+// messages above it are dropped before they are built, see LOG()
+extern std::atomic<int> logLevel;
+
+inline bool LogEnabled(LogLevel level) {
+    return level <= logLevel.load(std::memory_order_relaxed);
+}
+
+void LogWrite(LogLevel level, const std::string& msg);
+// Takes "error", "warn", "info" or "debug".
+bool ParseLogLevel(const char *name, LogLevel *level);
+// From then on, messages are queued and written to stderr by a background
+// thread. Once the queue is full, messages are dropped and counted.
+void StartAsyncLog();
+// Writes what is queued and goes back to writing messages directly.
+void StopAsyncLog();
+
+// msg is only evaluated if the level is enabled, so a disabled message
+// costs one branch.
+#define LOG(level, msg) \
+    do { if (LogEnabled(level)) LogWrite(level, (msg)); } while (0)
+#define LOG_ERROR(msg) LOG(LEVEL_ERROR, msg)
+#define LOG_WARN(msg) LOG(LEVEL_WARN, msg)
+#define LOG_INFO(msg) LOG(LEVEL_INFO, msg)
+#define LOG_DEBUG(msg) LOG(LEVEL_DEBUG, msg)
+
+#endif // __GPHOTOFS2_LOG_H_
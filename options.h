@@ -0,0 +1,86 @@
+#ifndef __GPHOTOFS2_OPTIONS_H_
+#define __GPHOTOFS2_OPTIONS_H_
+
+// Filled from -o options by fuse_opt_parse(), hence the plain C types.
+struct Options {
+    char *port;
+    char *model;
+    char *usbid;
+    int speed;
+
+    // memory budget of the content cache, in MiB
+    unsigned long cacheSize;
+    // directory of the persistent content cache, disabled if null
+    char *cacheDir;
+    // size cap of the persistent content cache, in MiB
+    unsigned long diskCacheSize;
+    // files being written past this size are kept in a temp file instead
+    // of memory, in MiB, 0 to never spill
+    unsigned long spillSize;
+    // upload closed files in the background, with at most writebackDepth
+    // of them waiting
+    int writeback;
+    unsigned long writebackDepth;
+    // read ahead readahead KiB of files read sequentially; when files of a
+    // dir are opened in order, load the next prefetchFiles of them, up to
+    // prefetchSize MiB
+    unsigned long readahead;
+    unsigned long prefetchFiles;
+    unsigned long prefetchSize;
+    // refresh dir listings older than dirTtl seconds in the background,
+    // 0 to keep them until remount
+    unsigned long dirTtl;
+    // list the tree in the background from mount on, down to crawlDepth
+    // levels for at most crawlTime seconds, 0 for no limit
+    int crawl;
+    unsigned long crawlDepth;
+    unsigned long crawlTime;
+    // follow camera events, polling every eventInterval ms
+    int events;
+    unsigned long eventInterval;
+    // serve a simulated camera instead of a real one: simFolders folders of
+    // simFiles files of simFileSize KiB, with simLatency us per call and
+    // simBandwidth KiB/s
+    int simulate;
+    unsigned long simFolders;
+    unsigned long simFiles;
+    unsigned long simFileSize;
+    unsigned long simLatency;
+    unsigned long simBandwidth;
+    // serve the previews of the files under /.previews, and cache up to
+    // previewCacheSize MiB of them
+    int previews;
+    unsigned long previewCacheSize;
+    // list dirs by name only, fetch file info in the background
+    int lazyInfo;
+    // same for dirs with more than listThreshold files, 0 for none
+    unsigned long listThreshold;
+    // record timelines of ops and camera calls, keeping the last traceSize
+    // events of each thread, and write them to the trace file on SIGUSR1
+    // and at unmount
+    char *trace;
+    unsigned long traceSize;
+    // least important messages logged: error, warn, info or debug
+    char *logLevel;
+    // serve the low-level FUSE API, with inode numbers
+    int lowLevel;
+    // how long the kernel may cache names, attributes and missing names, in
+    // seconds
+    double entryTimeout;
+    double attrTimeout;
+    double negativeTimeout;
+
+    Options() : port(nullptr), model(nullptr), usbid(nullptr), speed(0),
+        cacheSize(256), cacheDir(nullptr), diskCacheSize(4096),
+        spillSize(64), writeback(0), writebackDepth(8), readahead(1024),
+        prefetchFiles(0), prefetchSize(64), dirTtl(0), crawl(0),
+        crawlDepth(0), crawlTime(0), events(0), eventInterval(250),
+        simulate(0), simFolders(4), simFiles(100), simFileSize(4096),
+        simLatency(2000), simBandwidth(20000),
+        previews(0), previewCacheSize(32), lazyInfo(0),
+        listThreshold(1000), trace(nullptr), traceSize(16384),
+        logLevel(nullptr), lowLevel(0),
+        entryTimeout(1.0), attrTimeout(1.0), negativeTimeout(0.0) {}
+};
+
+#endif // __GPHOTOFS2_OPTIONS_H_
@@ -0,0 +1,106 @@
+#include "preview.h"
+#include "utils.h"
+
+#include <cerrno>
+
+#include <gphoto2/gphoto2.h>
+
+using namespace std;
+
+const char kPreviewRoot[] = "/.previews";
+
+// marks a preview fetch in File::fetching, no block has this index
+static const uint64_t kPreviewFetch = UINT64_MAX;
+// real inode numbers never get this high
+static const uint64_t kPreviewInoBit = 1ULL << 62;
+
+bool PreviewPath(const string& path, string *realPath, Context *ctx) {
+    if (!ctx->options().previews) return false;
+    size_t len = sizeof(kPreviewRoot) - 1;
+    if (path.compare(0, len, kPreviewRoot) != 0) return false;
+    if (path.size() == len) {
+        *realPath = "/";
+        return true;
+    }
+    if (path[len] != '/') return false;
+    *realPath = path.substr(len);
+    return true;
+}
+
+uint64_t PreviewIno(uint64_t ino) {
+    return ino | kPreviewInoBit;
+}
+
+static int FetchPreview(const string& path, IoPriority priority,
+        vector<char> *data, Context *ctx) {
+    string dirName = DirName(path);
+    string fileName = BaseName(path);
+    CameraFile *camFile;
+    gp_file_new(&camFile);
+    int ret = ctx->io().run(priority, [&] {
+        return ctx->camera().getFile(dirName, fileName, GP_FILE_TYPE_PREVIEW,
+                camFile);
+    });
+    if (ret == GP_OK) {
+        const char *bytes;
+        unsigned long size;
+        ret = gp_file_get_data_and_size(camFile, &bytes, &size);
+        if (ret == GP_OK) {
+            data->assign(bytes, bytes + size);
+            ctx->stats().bytesRead += size;
+        }
+    }
+    gp_file_unref(camFile);
+    return ret == GP_OK ? 0 : gpresultToErrno(ret);
+}
+
+// Errors that may go away when asked again, the others are remembered.
+static bool Transient(int err) {
+    return err == -EIO || err == -EBUSY || err == -ETIMEDOUT;
+}
+
+int GetPreview(File *file, IoPriority priority, shared_ptr<Block> *preview,
+        Context *ctx) {
+    if (file->previewError != 0) return file->previewError;
+    unique_lock<mutex> fileGuard(file->lock, adopt_lock);
+    int ret = 0;
+    while (true) {
+        *preview = ctx->previews().get(file, 0);
+        if (*preview) break;
+        if (file->fetching.count(kPreviewFetch) > 0) {
+            file->fetched.wait(fileGuard);
+            continue;
+        }
+
+        file->fetching.insert(kPreviewFetch);
+        uint64_t epoch = file->epoch;
+        shared_ptr<Block> block = make_shared<Block>();
+        fileGuard.unlock();
+        ret = FetchPreview(file->path, priority, &block->data, ctx);
+        fileGuard.lock();
+        file->fetching.erase(kPreviewFetch);
+        file->fetched.notify_all();
+        // the file changed while the lock was released
+        if (epoch != file->epoch) {
+            ret = 0;
+            continue;
+        }
+        if (ret != 0) {
+            if (!Transient(ret)) file->previewError = ret;
+            break;
+        }
+        ctx->previews().put(file, 0, block);
+        file->previewSize = block->data.size();
+        *preview = block;
+        break;
+    }
+    // still held by the caller
+    fileGuard.release();
+    return ret;
+}
+
+void ForgetPreview(File *file, Context *ctx) {
+    ctx->previews().drop(file);
+    file->previewSize = -1;
+    file->previewError = 0;
+}
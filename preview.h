@@ -0,0 +1,37 @@
+#ifndef __GPHOTOFS2_PREVIEW_H_
+#define __GPHOTOFS2_PREVIEW_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "cache.h"
+#include "context.h"
+#include "file.h"
+#include "io.h"
+
+/*
+ * With -o previews, /.previews mirrors the tree with the thumbnails the
+ * camera keeps for each file, so that photo browsers don't need to read
+ * the full images to draw a grid. Previews are whole objects, cached in
+ * their own BlockCache as block 0 of the file.
+ */
+
+extern const char kPreviewRoot[];
+
+// Returns true if path is in the preview tree, along with the path it
+// mirrors. Always false when previews are disabled.
+bool PreviewPath(const std::string& path, std::string *realPath,
+        Context *ctx);
+// Inode number of the preview of a node.
+uint64_t PreviewIno(uint64_t ino);
+// Gets the preview of a file, from the cache or the camera. A file without
+// one fails the same way again without asking the camera. file->lock must
+// be held, but is released while reading the camera.
+int GetPreview(File *file, IoPriority priority,
+        std::shared_ptr<Block> *preview, Context *ctx);
+// Drops what is known of the preview of a file whose contents changed.
+// file->lock must be held.
+void ForgetPreview(File *file, Context *ctx);
+
+#endif // __GPHOTOFS2_PREVIEW_H_
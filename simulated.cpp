@@ -0,0 +1,271 @@
+#include "simulated.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cstdio>
+
+using namespace std;
+
+static const char kStorage[] = "store_00010001";
+static const uint64_t kCapacity = 32ULL << 30;
+static const size_t kPreviewSize = 16 * 1024;
+// getFile() hands data over in pieces of this size, like USB transfers
+static const size_t kChunkSize = 64 * 1024;
+
+SimulatedBackend::SimulatedBackend(const SimConfig& config)
+        : config_(config), used_(0), calls_(0), bytes_(0) {
+    string storage = ChildPath("/", kStorage);
+    string dcim = ChildPath(storage, "DCIM");
+    folders_["/"];
+    addFolder("/", kStorage);
+    addFolder(storage, "DCIM");
+
+    time_t mtime = 1500000000;
+    uint32_t seed = 1;
+    // files are numbered across folders, wide enough to keep names unique
+    // and in order however many there are
+    unsigned long total = config_.folders * config_.files;
+    int width = max(4, (int)to_string(total > 0 ? total - 1 : 0).size());
+    for (unsigned long i = 0; i < config_.folders; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "%luSIMUL", 100 + i);
+        addFolder(dcim, name);
+        Folder& folder = folders_[ChildPath(dcim, name)];
+        for (unsigned long j = 0; j < config_.files; j++) {
+            char fileName[32];
+            snprintf(fileName, sizeof(fileName), "IMG_%0*lu.JPG", width,
+                    i * config_.files + j);
+            SimFile& file = folder.files[fileName];
+            file.size = (uint64_t)config_.fileSize << 10;
+            file.mtime = mtime++;
+            file.seed = seed++;
+            used_ += file.size;
+        }
+    }
+}
+
+char SimulatedBackend::Byte(uint32_t seed, uint64_t offset) {
+    return (char)((seed * 2654435761u + offset * 40503u) >> 8);
+}
+
+void SimulatedBackend::addFolder(const string& parent, const string& name) {
+    folders_[parent].dirs.insert(name);
+    folders_[ChildPath(parent, name)];
+}
+
+SimulatedBackend::SimFile* SimulatedBackend::find(const string& folder,
+        const string& name) {
+    auto it = folders_.find(folder);
+    if (it == folders_.end()) return nullptr;
+    auto file = it->second.files.find(name);
+    return file == it->second.files.end() ? nullptr : &file->second;
+}
+
+void SimulatedBackend::copy(const SimFile& file, uint64_t offset, char *buf,
+        size_t len) {
+    if (file.data) {
+        memcpy(buf, file.data->data() + offset, len);
+        return;
+    }
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = Byte(file.seed, offset + i);
+    }
+}
+
+void SimulatedBackend::transfer(uint64_t bytes) {
+    calls_++;
+    bytes_ += bytes;
+    uint64_t us = config_.latency;
+    if (config_.bandwidth > 0) {
+        us += bytes * 1000000 / ((uint64_t)config_.bandwidth << 10);
+    }
+    if (us > 0) usleep(us);
+}
+
+int SimulatedBackend::listFolders(const string& path, set<string> *names) {
+    transfer(0);
+    lock_guard<mutex> guard(lock_);
+    auto it = folders_.find(path);
+    if (it == folders_.end()) return GP_ERROR_DIRECTORY_NOT_FOUND;
+    *names = it->second.dirs;
+    return GP_OK;
+}
+
+int SimulatedBackend::listFiles(const string& path, set<string> *names) {
+    transfer(0);
+    lock_guard<mutex> guard(lock_);
+    auto it = folders_.find(path);
+    if (it == folders_.end()) return GP_ERROR_DIRECTORY_NOT_FOUND;
+    for (auto& file : it->second.files) {
+        names->insert(file.first);
+    }
+    return GP_OK;
+}
+
+int SimulatedBackend::getInfo(const string& folder, const string& name,
+        CameraFileInfo *info) {
+    transfer(0);
+    lock_guard<mutex> guard(lock_);
+    SimFile *file = find(folder, name);
+    if (file == nullptr) return GP_ERROR_FILE_NOT_FOUND;
+    memset(info, 0, sizeof(*info));
+    info->file.fields = (CameraFileInfoFields)(GP_FILE_INFO_TYPE |
+            GP_FILE_INFO_SIZE | GP_FILE_INFO_MTIME |
+            GP_FILE_INFO_PERMISSIONS | GP_FILE_INFO_STATUS);
+    strcpy(info->file.type, "image/jpeg");
+    info->file.size = file->size;
+    info->file.mtime = file->mtime;
+    info->file.permissions = GP_FILE_PERM_ALL;
+    info->file.status = GP_FILE_STATUS_NOT_DOWNLOADED;
+    return GP_OK;
+}
+
+int SimulatedBackend::getFile(const string& folder, const string& name,
+        CameraFileType type, CameraFile *camFile) {
+    SimFile file;
+    {
+        lock_guard<mutex> guard(lock_);
+        SimFile *found = find(folder, name);
+        if (found == nullptr) return GP_ERROR_FILE_NOT_FOUND;
+        file = *found;
+    }
+    uint64_t size;
+    if (type == GP_FILE_TYPE_NORMAL) {
+        size = file.size;
+    } else if (type == GP_FILE_TYPE_PREVIEW) {
+        size = min((uint64_t)kPreviewSize, file.size);
+    } else {
+        transfer(0);
+        return GP_ERROR_NOT_SUPPORTED;
+    }
+
+    vector<char> chunk(kChunkSize);
+    transfer(0);
+    for (uint64_t offset = 0; offset < size; offset += kChunkSize) {
+        size_t len = min((uint64_t)kChunkSize, size - offset);
+        transfer(len);
+        copy(file, offset, chunk.data(), len);
+        int ret = gp_file_append(camFile, chunk.data(), len);
+        if (ret != GP_OK) return ret;
+    }
+    return GP_OK;
+}
+
+int SimulatedBackend::readFile(const string& folder, const string& name,
+        uint64_t offset, char *buf, uint64_t *size) {
+    SimFile file;
+    {
+        lock_guard<mutex> guard(lock_);
+        SimFile *found = find(folder, name);
+        if (found == nullptr) return GP_ERROR_FILE_NOT_FOUND;
+        file = *found;
+    }
+    uint64_t len = offset < file.size ? min(*size, file.size - offset) : 0;
+    transfer(len);
+    copy(file, offset, buf, len);
+    *size = len;
+    return GP_OK;
+}
+
+int SimulatedBackend::putFile(const string& folder, const string& name,
+        CameraFile *camFile) {
+    shared_ptr<vector<char>> data = make_shared<vector<char>>();
+    while (true) {
+        size_t pos = data->size();
+        data->resize(pos + kChunkSize);
+        size_t got = 0;
+        int ret = gp_file_slurp(camFile, data->data() + pos, kChunkSize,
+                &got);
+        if (ret != GP_OK) return ret;
+        data->resize(pos + got);
+        if (got == 0) break;
+    }
+    transfer(data->size());
+
+    lock_guard<mutex> guard(lock_);
+    auto it = folders_.find(folder);
+    if (it == folders_.end()) return GP_ERROR_DIRECTORY_NOT_FOUND;
+    SimFile& file = it->second.files[name];
+    used_ -= file.size;
+    file.size = data->size();
+    file.mtime = Now();
+    file.data = data;
+    used_ += file.size;
+    return GP_OK;
+}
+
+int SimulatedBackend::deleteFile(const string& folder, const string& name) {
+    transfer(0);
+    lock_guard<mutex> guard(lock_);
+    auto it = folders_.find(folder);
+    if (it == folders_.end()) return GP_ERROR_DIRECTORY_NOT_FOUND;
+    auto file = it->second.files.find(name);
+    if (file == it->second.files.end()) return GP_ERROR_FILE_NOT_FOUND;
+    used_ -= file->second.size;
+    it->second.files.erase(file);
+    return GP_OK;
+}
+
+int SimulatedBackend::makeDir(const string& parent, const string& name) {
+    transfer(0);
+    lock_guard<mutex> guard(lock_);
+    auto it = folders_.find(parent);
+    if (it == folders_.end()) return GP_ERROR_DIRECTORY_NOT_FOUND;
+    if (it->second.dirs.count(name) > 0) return GP_ERROR_DIRECTORY_EXISTS;
+    addFolder(parent, name);
+    return GP_OK;
+}
+
+int SimulatedBackend::removeDir(const string& parent, const string& name) {
+    transfer(0);
+    lock_guard<mutex> guard(lock_);
+    string path = ChildPath(parent, name);
+    auto it = folders_.find(path);
+    if (it == folders_.end()) return GP_ERROR_DIRECTORY_NOT_FOUND;
+    if (!it->second.dirs.empty() || !it->second.files.empty()) {
+        return GP_ERROR;
+    }
+    folders_.erase(it);
+    folders_[parent].dirs.erase(name);
+    return GP_OK;
+}
+
+int SimulatedBackend::storageInfo(CameraStorageInformation **info,
+        int *count) {
+    transfer(0);
+    lock_guard<mutex> guard(lock_);
+    CameraStorageInformation *storage = (CameraStorageInformation *)calloc(1,
+            sizeof(CameraStorageInformation));
+    if (storage == nullptr) return GP_ERROR_NO_MEMORY;
+    storage->fields = (CameraStorageInfoFields)(GP_STORAGEINFO_BASE |
+            GP_STORAGEINFO_LABEL | GP_STORAGEINFO_MAXCAPACITY |
+            GP_STORAGEINFO_FREESPACEKBYTES);
+    snprintf(storage->basedir, sizeof(storage->basedir), "/%s", kStorage);
+    strcpy(storage->label, "Simulated");
+    storage->capacitykbytes = kCapacity >> 10;
+    storage->freekbytes = (kCapacity - min(used_, kCapacity)) >> 10;
+    *info = storage;
+    *count = 1;
+    return GP_OK;
+}
+
+int SimulatedBackend::summary(string *text) {
+    transfer(0);
+    *text = "Model: Simulated camera\nSerial Number: sim-" +
+        to_string(config_.folders) + "x" + to_string(config_.files) + "x" +
+        to_string(config_.fileSize) + "\n";
+    return GP_OK;
+}
+
+int SimulatedBackend::waitForEvent(int timeout, CameraEventType *type,
+        void **data) {
+    // the card never changes behind our back
+    usleep(timeout * 1000);
+    *type = GP_EVENT_TIMEOUT;
+    *data = nullptr;
+    return GP_OK;
+}
+
+string SimulatedBackend::counters() {
+    return "calls=" + to_string(calls_) + " bytes=" + to_string(bytes_);
+}
@@ -0,0 +1,86 @@
+#ifndef __GPHOTOFS2_SIMULATED_H_
+#define __GPHOTOFS2_SIMULATED_H_
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "backend.h"
+
+struct SimConfig {
+    // DCIM folders, and files in each
+    unsigned long folders;
+    unsigned long files;
+    // size of each file in KiB
+    unsigned long fileSize;
+    // time taken by every call in microseconds, and transfer rate in KiB/s
+    unsigned long latency;
+    unsigned long bandwidth;
+};
+
+/*
+ * An in-process camera with a synthetic card, for measuring the filesystem
+ * without hardware. Contents are generated from the path, so they can be
+ * checked; files written are kept in memory. Calls take the configured
+ * latency plus the time to transfer their data.
+ */
+class SimulatedBackend : public CameraBackend {
+public:
+    explicit SimulatedBackend(const SimConfig& config);
+
+    int listFolders(const std::string& path,
+            std::set<std::string> *names) override;
+    int listFiles(const std::string& path,
+            std::set<std::string> *names) override;
+    int getInfo(const std::string& folder, const std::string& name,
+            CameraFileInfo *info) override;
+    int getFile(const std::string& folder, const std::string& name,
+            CameraFileType type, CameraFile *file) override;
+    int readFile(const std::string& folder, const std::string& name,
+            uint64_t offset, char *buf, uint64_t *size) override;
+    int putFile(const std::string& folder, const std::string& name,
+            CameraFile *file) override;
+    int deleteFile(const std::string& folder,
+            const std::string& name) override;
+    int makeDir(const std::string& parent, const std::string& name) override;
+    int removeDir(const std::string& parent,
+            const std::string& name) override;
+    int storageInfo(CameraStorageInformation **info, int *count) override;
+    int summary(std::string *text) override;
+    int waitForEvent(int timeout, CameraEventType *type,
+            void **data) override;
+    std::string counters() override;
+
+    // Byte at offset of the generated contents of a file.
+    static char Byte(uint32_t seed, uint64_t offset);
+
+private:
+    struct SimFile {
+        uint64_t size;
+        time_t mtime;
+        uint32_t seed;
+        // written contents, null for generated ones
+        std::shared_ptr<std::vector<char>> data;
+    };
+    struct Folder {
+        std::set<std::string> dirs;
+        std::map<std::string, SimFile> files;
+    };
+
+    void addFolder(const std::string& parent, const std::string& name);
+    SimFile* find(const std::string& folder, const std::string& name);
+    void copy(const SimFile& file, uint64_t offset, char *buf, size_t len);
+    // Sleeps for the latency and the transfer of bytes.
+    void transfer(uint64_t bytes);
+
+    SimConfig config_;
+    std::mutex lock_;
+    std::map<std::string, Folder> folders_;
+    uint64_t used_;
+    std::atomic<uint64_t> calls_;
+    std::atomic<uint64_t> bytes_;
+};
+
+#endif // __GPHOTOFS2_SIMULATED_H_
@@ -0,0 +1,187 @@
+#include "snapshot.h"
+#include "file.h"
+#include "utils.h"
+#include "log.h"
+
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+/*
+ * Layout, in host byte order so that it can be walked in place:
+ *   SnapshotHeader
+ *   SnapshotNode[nodeCount], root first and parents before children
+ *   string table, the key and then the names
+ */
+static const char kMagic[8] = {'G', 'P', 'F', 'S', '2', 'S', 'N', '1'};
+static const uint32_t kNoParent = 0xffffffff;
+static const uint32_t kDirNode = 1;
+static const uint32_t kListedNode = 2;
+static const uint32_t kPendingNode = 4;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t nodeCount;
+    uint32_t keyLen;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+};
+
+struct SnapshotNode {
+    uint32_t parent;
+    uint32_t flags;
+    uint32_t nameOffset;
+    uint32_t nameLen;
+    int64_t size;
+    int64_t mtime;
+};
+
+bool SaveSnapshot(const string& path, const string& key, Dir& root) {
+    vector<SnapshotNode> nodes;
+    string strings = key;
+
+    auto addNode = [&](uint32_t parent, uint32_t flags, const string& name,
+            int64_t size, int64_t mtime) {
+        SnapshotNode node;
+        node.parent = parent;
+        node.flags = flags;
+        node.nameOffset = strings.size();
+        node.nameLen = name.size();
+        node.size = size;
+        node.mtime = mtime;
+        strings += name;
+        nodes.push_back(node);
+    };
+
+    deque<pair<Dir*, uint32_t>> queue;
+    addNode(kNoParent, kDirNode | (root.listed ? kListedNode : 0), "", 0, 0);
+    queue.push_back(make_pair(&root, 0));
+    while (!queue.empty()) {
+        Dir *dir = queue.front().first;
+        uint32_t index = queue.front().second;
+        queue.pop_front();
+        if (!dir->listed) continue;
+
+        for (auto& it : dir->dirs) {
+            Dir *subDir = it.second;
+            queue.push_back(make_pair(subDir, nodes.size()));
+            addNode(index, kDirNode | (subDir->listed ? kListedNode : 0),
+                    subDir->name, 0, 0);
+        }
+        for (auto& it : dir->files) {
+            File *file = it.second;
+            // not on the camera yet
+            if (file->changed) continue;
+            addNode(index, file->infoPending ? kPendingNode : 0, file->name,
+                    file->camSize, file->mtime);
+        }
+    }
+
+    SnapshotHeader header;
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.nodeCount = nodes.size();
+    header.keyLen = key.size();
+    header.stringsOffset = sizeof(header) + nodes.size() * sizeof(SnapshotNode);
+    header.stringsSize = strings.size();
+
+    string tmpPath = path + ".tmp";
+    FILE *out = fopen(tmpPath.c_str(), "wb");
+    if (out == nullptr) {
+        LOG_WARN("can't write snapshot " + tmpPath);
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+        fwrite(nodes.data(), sizeof(SnapshotNode), nodes.size(), out) ==
+            nodes.size() &&
+        fwrite(strings.data(), 1, strings.size(), out) == strings.size() &&
+        fflush(out) == 0 && fsync(fileno(out)) == 0;
+    fclose(out);
+    if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+        LOG_WARN("can't save snapshot " + path);
+        unlink(tmpPath.c_str());
+        return false;
+    }
+    LOG_DEBUG("saved snapshot with " + to_string(nodes.size()) + " nodes");
+    return true;
+}
+
+bool LoadSnapshot(const string& path, const string& key, Dir& root) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(SnapshotHeader)) {
+        close(fd);
+        return false;
+    }
+    size_t length = st.st_size;
+    void *map = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    const char *base = (const char *)map;
+    const SnapshotHeader *header = (const SnapshotHeader *)base;
+    const SnapshotNode *nodes = (const SnapshotNode *)(header + 1);
+    const char *strings = base + header->stringsOffset;
+    bool ok = memcmp(header->magic, kMagic, sizeof(kMagic)) == 0 &&
+        header->nodeCount > 0 &&
+        header->stringsOffset == sizeof(SnapshotHeader) +
+            (uint64_t)header->nodeCount * sizeof(SnapshotNode) &&
+        header->stringsOffset + header->stringsSize == length &&
+        header->keyLen == key.size() &&
+        memcmp(strings, key.data(), key.size()) == 0;
+    if (!ok) {
+        LOG_DEBUG("no usable snapshot in " + path);
+        munmap(map, length);
+        return false;
+    }
+
+    for (uint32_t i = 1; ok && i < header->nodeCount; i++) {
+        const SnapshotNode& node = nodes[i];
+        ok = node.parent < i && (nodes[node.parent].flags & kDirNode) &&
+            (uint64_t)node.nameOffset + node.nameLen <= header->stringsSize;
+    }
+    if (!ok) {
+        LOG_WARN("corrupted snapshot " + path);
+        munmap(map, length);
+        return false;
+    }
+
+    vector<Dir*> dirs(header->nodeCount, nullptr);
+    dirs[0] = &root;
+    // listings are as good as fresh ones until the revalidation catches up
+    int now = Now();
+    root.listed = nodes[0].flags & kListedNode;
+    if (root.listed) root.listedAt = now;
+    for (uint32_t i = 1; i < header->nodeCount; i++) {
+        const SnapshotNode& node = nodes[i];
+        Dir *parent = dirs[node.parent];
+        string name(strings + node.nameOffset, node.nameLen);
+        if (node.flags & kDirNode) {
+            Dir *dir = new Dir(name);
+            dir->listed = node.flags & kListedNode;
+            if (dir->listed) dir->listedAt = now;
+            if (!parent->addDir(dir)) delete dir;
+            dirs[i] = parent->getDir(name);
+        } else {
+            File *file = new File(name, node.size, node.mtime);
+            file->infoPending = node.flags & kPendingNode;
+            if (!parent->addFile(file)) delete file;
+        }
+    }
+    munmap(map, length);
+    LOG_DEBUG("loaded snapshot with " + to_string(header->nodeCount) +
+            " nodes");
+    return true;
+}
@@ -0,0 +1,15 @@
+#ifndef __GPHOTOFS2_SNAPSHOT_H_
+#define __GPHOTOFS2_SNAPSHOT_H_
+
+#include <string>
+
+#include "dir.h"
+
+// Snapshots of the listed part of the Dir/File tree, so that a known card
+// can be browsed right after mount. The key identifies the card, a
+// snapshot saved under a different key is ignored.
+bool SaveSnapshot(const std::string& path, const std::string& key, Dir& root);
+// Fills an empty root from the snapshot, listed dirs are marked listed.
+bool LoadSnapshot(const std::string& path, const std::string& key, Dir& root);
+
+#endif // __GPHOTOFS2_SNAPSHOT_H_
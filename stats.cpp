@@ -0,0 +1,106 @@
+#include "stats.h"
+
+using namespace std;
+
+static const char *kOpNames[STAT_NUM_OPS] = {
+    "getattr", "readdir", "mkdir", "rmdir", "create", "open", "release",
+    "unlink", "read", "write", "flush", "fsync", "truncate", "statfs",
+    "getxattr", "listxattr",
+};
+
+static const char *kCallNames[CALL_NUM_CALLS] = {
+    "list_folders", "list_files", "get_info", "get_file", "read_file",
+    "put_file", "delete_file", "make_dir", "remove_dir", "storage_info",
+    "summary", "wait_for_event",
+};
+
+static const char *kPriorityNames[IO_NUM_PRIORITIES] = {
+    "meta", "read", "background",
+};
+
+const char *StatOpName(StatOp op) {
+    return kOpNames[op];
+}
+
+const char *StatCallName(StatCall call) {
+    return kCallNames[call];
+}
+
+void AddStat(StatValues *values, const string& name, uint64_t value) {
+    values->push_back(StatValue{name, to_string(value), true});
+}
+
+void AddStat(StatValues *values, const string& name, const string& value) {
+    values->push_back(StatValue{name, value, false});
+}
+
+string FormatStats(const StatValues& values, bool json) {
+    string out = json ? "{\n" : "";
+    for (size_t i = 0; i < values.size(); i++) {
+        const StatValue& value = values[i];
+        if (!json) {
+            out += value.name + " " + value.value + "\n";
+            continue;
+        }
+        out += "  " + JsonQuote(value.name) + ": " +
+            (value.number ? value.value : JsonQuote(value.value)) +
+            (i + 1 < values.size() ? ",\n" : "\n");
+    }
+    return json ? out + "}\n" : out;
+}
+
+// Skips histograms that never saw anything, to keep the report short.
+static void AddHistogram(StatValues *values, const string& name,
+        Histogram& histogram) {
+    uint64_t count = histogram.count();
+    if (count == 0) return;
+    AddStat(values, name + ".count", count);
+    AddStat(values, name + ".avg_us", histogram.total() / count);
+    AddStat(values, name + ".p50_us", histogram.percentile(50));
+    AddStat(values, name + ".p90_us", histogram.percentile(90));
+    AddStat(values, name + ".p99_us", histogram.percentile(99));
+    AddStat(values, name + ".max_us", histogram.max());
+}
+
+Stats::Stats() : bytesRead(0), bytesWritten(0), cacheHits(0), diskHits(0),
+        cacheMisses(0), callsRunning(0), downloadsRunning(0) {
+}
+
+void Stats::values(StatValues *values) {
+    for (int i = 0; i < STAT_NUM_OPS; i++) {
+        AddHistogram(values, string("op.") + kOpNames[i], ops_[i]);
+    }
+    for (int i = 0; i < CALL_NUM_CALLS; i++) {
+        AddHistogram(values, string("camera.") + kCallNames[i], calls_[i]);
+    }
+    for (int i = 0; i < IO_NUM_PRIORITIES; i++) {
+        AddHistogram(values, string("io_wait.") + kPriorityNames[i],
+                ioWait[i]);
+    }
+    AddHistogram(values, "file_lock_wait", fileLockWait);
+
+    AddStat(values, "bytes.read", bytesRead);
+    AddStat(values, "bytes.written", bytesWritten);
+    uint64_t hits = cacheHits, disk = diskHits, misses = cacheMisses;
+    AddStat(values, "cache.hits", hits);
+    AddStat(values, "cache.disk_hits", disk);
+    AddStat(values, "cache.misses", misses);
+    // per mille, so that it stays an integer
+    uint64_t lookups = hits + disk + misses;
+    AddStat(values, "cache.hit_permille",
+            lookups > 0 ? (hits + disk) * 1000 / lookups : 0);
+    AddStat(values, "in_flight.camera_calls", (uint64_t)callsRunning);
+    AddStat(values, "in_flight.downloads", (uint64_t)downloadsRunning);
+}
+
+void Stats::reset() {
+    for (auto& histogram : ops_) histogram.reset();
+    for (auto& histogram : calls_) histogram.reset();
+    for (auto& histogram : ioWait) histogram.reset();
+    fileLockWait.reset();
+    bytesRead = 0;
+    bytesWritten = 0;
+    cacheHits = 0;
+    diskHits = 0;
+    cacheMisses = 0;
+}
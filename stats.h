@@ -0,0 +1,80 @@
+#ifndef __GPHOTOFS2_STATS_H_
+#define __GPHOTOFS2_STATS_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "histogram.h"
+#include "io.h"
+
+// FUSE ops, the low-level ones are counted as the op they map to.
+enum StatOp {
+    STAT_GETATTR = 0, STAT_READDIR, STAT_MKDIR, STAT_RMDIR, STAT_CREATE,
+    STAT_OPEN, STAT_RELEASE, STAT_UNLINK, STAT_READ, STAT_WRITE, STAT_FLUSH,
+    STAT_FSYNC, STAT_TRUNCATE, STAT_STATFS, STAT_GETXATTR, STAT_LISTXATTR,
+    STAT_NUM_OPS
+};
+
+// Calls of CameraBackend.
+enum StatCall {
+    CALL_LIST_FOLDERS = 0, CALL_LIST_FILES, CALL_GET_INFO, CALL_GET_FILE,
+    CALL_READ_FILE, CALL_PUT_FILE, CALL_DELETE_FILE, CALL_MAKE_DIR,
+    CALL_REMOVE_DIR, CALL_STORAGE_INFO, CALL_SUMMARY, CALL_WAIT_FOR_EVENT,
+    CALL_NUM_CALLS
+};
+
+const char *StatOpName(StatOp op);
+const char *StatCallName(StatCall call);
+
+// A named value of a report, numbers are written without quotes in JSON.
+struct StatValue {
+    std::string name;
+    std::string value;
+    bool number;
+};
+typedef std::vector<StatValue> StatValues;
+
+void AddStat(StatValues *values, const std::string& name, uint64_t value);
+void AddStat(StatValues *values, const std::string& name,
+        const std::string& value);
+// "name value" lines, or a flat JSON object.
+std::string FormatStats(const StatValues& values, bool json);
+
+/*
+ * Counters of the mount, updated without locks. Gauges such as queue depths
+ * are read from their owners when a report is made.
+ */
+class Stats {
+public:
+    Histogram& op(StatOp op) { return ops_[op]; }
+    Histogram& call(StatCall call) { return calls_[call]; }
+
+    // time camera requests wait for the camera thread, by IoPriority
+    Histogram ioWait[IO_NUM_PRIORITIES];
+    // time reads and writes wait for the lock of their file
+    Histogram fileLockWait;
+    // contents transferred from and to the camera
+    std::atomic<uint64_t> bytesRead;
+    std::atomic<uint64_t> bytesWritten;
+    // blocks found in the content cache, read from the disk cache, and
+    // fetched from the camera
+    std::atomic<uint64_t> cacheHits;
+    std::atomic<uint64_t> diskHits;
+    std::atomic<uint64_t> cacheMisses;
+    // camera calls and whole file downloads running
+    std::atomic<int> callsRunning;
+    std::atomic<int> downloadsRunning;
+
+    Stats();
+    // Adds the counters and histograms, but not the gauges, to values.
+    void values(StatValues *values);
+    void reset();
+
+private:
+    Histogram ops_[STAT_NUM_OPS];
+    Histogram calls_[CALL_NUM_CALLS];
+};
+
+#endif // __GPHOTOFS2_STATS_H_
@@ -0,0 +1,196 @@
+#include "trace.h"
+#include "utils.h"
+#include "log.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+atomic<bool> traceEnabled(false);
+
+struct TraceRecord {
+    uint64_t ts;
+    uint64_t bytes;
+    const char *category;
+    const char *name;
+    char phase;
+    char path[87];
+};
+
+struct TraceSlot {
+    // 2n+1 while event n is written into the slot, 2n+2 once it's complete
+    atomic<uint64_t> seq;
+    TraceRecord record;
+};
+
+// Events of one thread, only written by it.
+struct TraceRing {
+    int tid;
+    size_t size;
+    unique_ptr<TraceSlot[]> slots;
+    // events written so far
+    atomic<uint64_t> head;
+
+    TraceRing(int tid, size_t size)
+        : tid(tid), size(size), slots(new TraceSlot[size]), head(0) {
+        for (size_t i = 0; i < size; i++) slots[i].seq = 0;
+    }
+};
+
+static mutex ringsLock;
+static vector<TraceRing*> rings;
+static size_t ringSize;
+static string tracePath;
+static mutex dumpLock;
+// SIGUSR1 writes to it, the dump thread reads it
+static int signalPipe[2] = {-1, -1};
+static thread dumpThread;
+
+static thread_local TraceRing *threadRing = nullptr;
+
+static TraceRing* ThreadRing() {
+    if (threadRing != nullptr) return threadRing;
+    TraceRing *ring = new TraceRing(syscall(SYS_gettid), ringSize);
+    lock_guard<mutex> guard(ringsLock);
+    rings.push_back(ring);
+    threadRing = ring;
+    return ring;
+}
+
+void TraceEvent(char phase, const char *category, const char *name,
+        const char *path, const char *child, uint64_t bytes) {
+    TraceRing *ring = ThreadRing();
+    uint64_t n = ring->head.load(memory_order_relaxed);
+    TraceSlot& slot = ring->slots[n % ring->size];
+    slot.seq.store(2 * n + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    TraceRecord& record = slot.record;
+    record.ts = MonotonicUs();
+    record.bytes = bytes;
+    record.category = category;
+    record.name = name;
+    record.phase = phase;
+    record.path[0] = '\0';
+    if (path != nullptr) {
+        snprintf(record.path, sizeof(record.path), child ? "%s/%s" : "%s",
+                path, child);
+    }
+    slot.seq.store(2 * n + 2, memory_order_release);
+    ring->head.store(n + 1, memory_order_release);
+}
+
+/*
+ * Copies the complete events of a ring, oldest first. Events overwritten
+ * while being copied are skipped.
+ */
+static void CopyEvents(TraceRing *ring, vector<TraceRecord> *records) {
+    uint64_t head = ring->head.load(memory_order_acquire);
+    uint64_t first = head > ring->size ? head - ring->size : 0;
+    for (uint64_t n = first; n < head; n++) {
+        TraceSlot& slot = ring->slots[n % ring->size];
+        if (slot.seq.load(memory_order_acquire) != 2 * n + 2) continue;
+        TraceRecord record = slot.record;
+        atomic_thread_fence(memory_order_acquire);
+        if (slot.seq.load(memory_order_relaxed) != 2 * n + 2) continue;
+        record.path[sizeof(record.path) - 1] = '\0';
+        records->push_back(record);
+    }
+}
+
+int DumpTrace() {
+    lock_guard<mutex> dumpGuard(dumpLock);
+    if (tracePath.empty()) return -EINVAL;
+    vector<TraceRing*> current;
+    {
+        lock_guard<mutex> guard(ringsLock);
+        current = rings;
+    }
+
+    string tmpPath = tracePath + ".tmp";
+    FILE *out = fopen(tmpPath.c_str(), "w");
+    if (out == nullptr) {
+        int err = errno;
+        LOG_WARN("cannot write trace " + tmpPath + ": " + strerror(err));
+        return -err;
+    }
+    fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool first = true;
+    pid_t pid = getpid();
+    for (TraceRing *ring : current) {
+        vector<TraceRecord> records;
+        CopyEvents(ring, &records);
+        for (const TraceRecord& record : records) {
+            fprintf(out, "%s{\"ph\": \"%c\", \"cat\": \"%s\", "
+                    "\"name\": \"%s\", \"ts\": %llu, \"pid\": %d, "
+                    "\"tid\": %d", first ? "" : ",\n", record.phase,
+                    record.category, record.name,
+                    (unsigned long long)record.ts, (int)pid, ring->tid);
+            if (record.phase == 'B') {
+                fprintf(out, ", \"args\": {\"path\": %s, \"bytes\": %llu}",
+                        JsonQuote(record.path).c_str(),
+                        (unsigned long long)record.bytes);
+            }
+            fprintf(out, "}");
+            first = false;
+        }
+    }
+    fprintf(out, "\n]}\n");
+    if (fclose(out) != 0 ||
+            rename(tmpPath.c_str(), tracePath.c_str()) != 0) {
+        int err = errno;
+        LOG_WARN("cannot write trace " + tracePath + ": " + strerror(err));
+        return -err;
+    }
+    return 0;
+}
+
+static void OnSignal(int signum) {
+    char c = 'd';
+    ssize_t ret = write(signalPipe[1], &c, 1);
+    (void)ret;
+}
+
+// Dumps on each SIGUSR1, until the write end of the pipe is closed.
+static void DumpOnSignal() {
+    char c;
+    while (read(signalPipe[0], &c, 1) == 1) {
+        DumpTrace();
+    }
+}
+
+void StartTracing(const string& path, size_t eventsPerThread) {
+    tracePath = path;
+    ringSize = eventsPerThread > 0 ? eventsPerThread : 1;
+    if (pipe(signalPipe) == 0) {
+        dumpThread = thread(DumpOnSignal);
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = OnSignal;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1, &action, nullptr);
+    }
+    traceEnabled = true;
+}
+
+void StopTracing() {
+    if (!traceEnabled) return;
+    traceEnabled = false;
+    if (dumpThread.joinable()) {
+        signal(SIGUSR1, SIG_DFL);
+        close(signalPipe[1]);
+        dumpThread.join();
+        close(signalPipe[0]);
+    }
+    DumpTrace();
+}
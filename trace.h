@@ -0,0 +1,56 @@
+#ifndef __GPHOTOFS2_TRACE_H_
+#define __GPHOTOFS2_TRACE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/*
+ * Timelines of FUSE ops and camera calls, written as Chrome trace JSON
+ * (chrome://tracing, ui.perfetto.dev). Each thread records begin and end
+ * events into its own ring, without locks; the oldest events are
+ * overwritten once a ring is full. When tracing is off, a span costs one
+ * relaxed load.
+ */
+
+// checked by every span, see Tracing()
+extern std::atomic<bool> traceEnabled;
+
+inline bool Tracing() {
+    return traceEnabled.load(std::memory_order_relaxed);
+}
+
+// Starts recording up to eventsPerThread events in each thread, and dumps
+// them to path on SIGUSR1.
+void StartTracing(const std::string& path, size_t eventsPerThread);
+// Writes the events recorded so far to the trace file.
+int DumpTrace();
+// Stops recording and dumps the trace. Rings stay allocated, as threads
+// may still be in a span.
+void StopTracing();
+
+void TraceEvent(char phase, const char *category, const char *name,
+        const char *path, const char *child, uint64_t bytes);
+
+// A span from construction to destruction. path is joined with child, if
+// given, and both are only copied when tracing.
+class TraceScope {
+public:
+    TraceScope(const char *category, const char *name, const char *path,
+            const char *child = nullptr, uint64_t bytes = 0)
+            : category_(category), name_(name), active_(Tracing()) {
+        if (active_) TraceEvent('B', category, name, path, child, bytes);
+    }
+    ~TraceScope() {
+        if (active_) {
+            TraceEvent('E', category_, name_, nullptr, nullptr, 0);
+        }
+    }
+
+private:
+    const char *category_;
+    const char *name_;
+    bool active_;
+};
+
+#endif // __GPHOTOFS2_TRACE_H_
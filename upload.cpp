@@ -0,0 +1,127 @@
+#include "upload.h"
+
+#include <algorithm>
+
+using namespace std;
+
+// backoff of the first retry, doubled up to the maximum
+static const int kRetrySeconds = 1;
+static const int kMaxRetrySeconds = 60;
+
+UploadQueue::UploadQueue(size_t depth) : depth_(depth > 0 ? depth : 1),
+        current_{nullptr, 0, 0, {}}, pendingBytes_(0), stop_(false) {
+}
+
+UploadQueue::~UploadQueue() {
+    stop();
+}
+
+void UploadQueue::start(UploadFunc upload) {
+    upload_ = upload;
+    thread_ = thread(&UploadQueue::run, this);
+}
+
+bool UploadQueue::started() {
+    return thread_.joinable();
+}
+
+// Files queued by push() and not tried yet.
+size_t UploadQueue::waiting() {
+    size_t count = 0;
+    for (const Entry& entry : queue_) {
+        if (entry.attempts == 0) count++;
+    }
+    return count;
+}
+
+void UploadQueue::push(File *file, uint64_t bytes) {
+    unique_lock<mutex> guard(lock_);
+    cond_.wait(guard, [this] { return waiting() < depth_ || stop_; });
+    queue_.push_back(Entry{file, bytes, 0, {}});
+    pendingBytes_ += bytes;
+    cond_.notify_all();
+}
+
+bool UploadQueue::busy(File *file) {
+    if (current_.file == file) return true;
+    for (const Entry& entry : queue_) {
+        if (entry.file == file && entry.attempts == 0) return true;
+    }
+    return false;
+}
+
+void UploadQueue::wait(File *file) {
+    unique_lock<mutex> guard(lock_);
+    cond_.wait(guard, [this, file] { return !busy(file); });
+}
+
+uint64_t UploadQueue::pendingBytes() {
+    lock_guard<mutex> guard(lock_);
+    return pendingBytes_;
+}
+
+size_t UploadQueue::pendingFiles() {
+    lock_guard<mutex> guard(lock_);
+    return queue_.size() + (current_.file != nullptr ? 1 : 0);
+}
+
+void UploadQueue::stop() {
+    {
+        lock_guard<mutex> guard(lock_);
+        stop_ = true;
+        cond_.notify_all();
+    }
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+bool UploadQueue::next(Clock::time_point *due) {
+    Clock::time_point now = Clock::now();
+    for (auto it = queue_.begin(); it != queue_.end(); it++) {
+        // Unmounting, but the queued data must still reach the camera.
+        if (stop_ || it->retryAt <= now) {
+            current_ = *it;
+            queue_.erase(it);
+            return true;
+        }
+        *due = min(*due, it->retryAt);
+    }
+    return false;
+}
+
+void UploadQueue::run() {
+    while (true) {
+        bool last;
+        {
+            unique_lock<mutex> guard(lock_);
+            while (true) {
+                Clock::time_point due = Clock::time_point::max();
+                if (next(&due)) break;
+                if (queue_.empty() && stop_) return;
+                if (due == Clock::time_point::max()) {
+                    cond_.wait(guard);
+                } else {
+                    cond_.wait_until(guard, due);
+                }
+            }
+            last = stop_;
+            cond_.notify_all();
+        }
+        bool done = upload_(current_.file, last);
+        {
+            lock_guard<mutex> guard(lock_);
+            if (done) {
+                pendingBytes_ -= current_.bytes;
+            } else {
+                int delay = min(kRetrySeconds << min(current_.attempts, 6),
+                        kMaxRetrySeconds);
+                current_.attempts++;
+                current_.retryAt = Clock::now() + chrono::seconds(delay);
+                queue_.push_back(current_);
+            }
+            current_ = Entry{nullptr, 0, 0, {}};
+            cond_.notify_all();
+        }
+    }
+}
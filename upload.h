@@ -0,0 +1,72 @@
+#ifndef __GPHOTOFS2_UPLOAD_H_
+#define __GPHOTOFS2_UPLOAD_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+struct File;
+
+// Uploads closed files in the background, in the order they were queued.
+// Each queued file holds a reference, which the upload function releases.
+// Failed uploads are queued again and retried with backoff.
+class UploadQueue {
+public:
+    // Uploads a file. Returns false if it failed and is to be tried again,
+    // keeping the reference. With last set, it is the final try before
+    // unmounting, and the reference must be released either way.
+    typedef std::function<bool(File*, bool last)> UploadFunc;
+
+    // At most depth files are queued, push() waits for room beyond that.
+    // Files waiting for a retry don't count.
+    explicit UploadQueue(size_t depth);
+    ~UploadQueue();
+
+    void start(UploadFunc upload);
+    bool started();
+    void push(File *file, uint64_t bytes);
+    // Waits until the uploads of file queued so far are done, or have
+    // failed and wait for a retry.
+    void wait(File *file);
+    // bytes of the queued files that are not on the camera yet
+    uint64_t pendingBytes();
+    // files queued or being uploaded
+    size_t pendingFiles();
+    // Tries what is queued once more, without waiting for backoffs, and
+    // stops the thread.
+    void stop();
+
+private:
+    typedef std::chrono::steady_clock Clock;
+    struct Entry {
+        File *file;
+        uint64_t bytes;
+        // failed uploads so far, and when to try again
+        int attempts;
+        Clock::time_point retryAt;
+    };
+
+    void run();
+    bool busy(File *file);
+    size_t waiting();
+    // Takes the next entry that is due into current_, or returns false and
+    // sets when one will be.
+    bool next(Clock::time_point *due);
+
+    size_t depth_;
+    UploadFunc upload_;
+    std::mutex lock_;
+    std::condition_variable cond_;
+    std::deque<Entry> queue_;
+    // being uploaded, still counted in pendingBytes()
+    Entry current_;
+    uint64_t pendingBytes_;
+    bool stop_;
+    std::thread thread_;
+};
+
+#endif // __GPHOTOFS2_UPLOAD_H_
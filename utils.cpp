@@ -1,37 +1,70 @@
 #include "utils.h"
+#include "log.h"
 #include <gphoto2/gphoto2.h>
-#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
 #include <sys/time.h>
+#include <unistd.h>
 using namespace std;
 
-static bool debug = false;
-
 int Now() {
     struct timeval tv;
     gettimeofday(&tv, NULL);
     return tv.tv_sec;
 }
 
-void Error(const string& msg) {
-    cerr << "ERR: " << msg << endl;
+uint64_t MonotonicUs() {
+    return chrono::duration_cast<chrono::microseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+off_t SizeToBlocks(off_t size) {
+    return size / 512 + (size % 512 ? 1 : 0);
+}
+
+string DirName(const string& path) {
+    size_t pos = path.rfind('/');
+    if (pos == string::npos) return ".";
+    if (pos == 0) return "/";
+    return path.substr(0, pos);
 }
 
-void Warn(const string& msg) {
-    cerr << "WARN: " << msg << endl;
+string BaseName(const string& path) {
+    size_t pos = path.rfind('/');
+    if (pos == string::npos) return path;
+    return path.substr(pos + 1);
 }
 
-void Debug(const string& msg) {
-    if (debug) {
-        cerr << "DBG: " << msg << endl;
+string ChildPath(const string& parent, const string& name) {
+    if (parent.empty() || parent[parent.size() - 1] != '/') {
+        return parent + "/" + name;
     }
+    return parent + name;
 }
 
-off_t SizeToBlocks(off_t size) {
-    return size / 512 + (size % 512 ? 1 : 0);
+// 64-bit FNV-1a, in hex
+string HashString(const string& str) {
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char c : str) {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)h);
+    return buf;
+}
+
+uint64_t NewInode() {
+    // 1 is the root, see Context
+    static atomic<uint64_t> next(2);
+    return next++;
 }
 
 int gpresultToErrno(int result) {
-   Error(string("gphoto error ") + to_string(result));
+   LOG_ERROR(string("gphoto error ") + to_string(result));
    switch (result) {
    case GP_ERROR:
       return -EPROTO;
@@ -87,4 +120,31 @@ int gpresultToErrno(int result) {
    return -EINVAL;
 }
 
+int TempFile(const char *dir, const char *what) {
+    if (dir == nullptr) dir = getenv("TMPDIR");
+    if (dir == nullptr) dir = "/tmp";
+    string name = string(dir) + "/gphotofs2-" + what + "-XXXXXX";
+    int fd = mkstemp(&name[0]);
+    if (fd < 0) {
+        return -errno;
+    }
+    unlink(name.c_str());
+    return fd;
+}
 
+string JsonQuote(const string& str) {
+    string out = "\"";
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            out.push_back('\\');
+            out.push_back(c);
+        } else if ((unsigned char)c < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            out += escape;
+        } else {
+            out.push_back(c);
+        }
+    }
+    return out + "\"";
+}
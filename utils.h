@@ -1,13 +1,25 @@
 #ifndef __GPHOTOFS2_UTILS_H_
 #define __GPHOTOFS2_UTILS_H_
 
+#include <cstdint>
 #include <string>
 
 int Now();
-void Error(const std::string& msg);
-void Warn(const std::string& msg);
-void Debug(const std::string& msg);
+// Microseconds on a monotonic clock, for measuring durations.
+uint64_t MonotonicUs();
 off_t SizeToBlocks(off_t size);
 int gpresultToErrno(int result);
+std::string HashString(const std::string& str);
+// Inode number for a new node, never reused during a mount
+uint64_t NewInode();
+// Thread-safe replacements of dirname() and basename()
+std::string DirName(const std::string& path);
+std::string BaseName(const std::string& path);
+std::string ChildPath(const std::string& parent, const std::string& name);
+// Creates an unlinked temp file in dir, or in TMPDIR if dir is null, named
+// after what it holds. Returns its fd, or a negative errno.
+int TempFile(const char *dir, const char *what);
+// str as a quoted JSON string
+std::string JsonQuote(const std::string& str);
 
 #endif // __GPHOTOFS2_UTILS_H_
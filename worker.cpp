@@ -0,0 +1,49 @@
+#include "worker.h"
+
+using namespace std;
+
+Worker::Worker() : stop_(false) {
+    thread_ = thread(&Worker::run, this);
+}
+
+Worker::~Worker() {
+    stop();
+}
+
+void Worker::submit(function<void()> job) {
+    lock_guard<mutex> guard(lock_);
+    if (stop_) return;
+    jobs_.push_back(job);
+    cond_.notify_one();
+}
+
+void Worker::stop() {
+    {
+        lock_guard<mutex> guard(lock_);
+        stop_ = true;
+        jobs_.clear();
+        cond_.notify_one();
+    }
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+bool Worker::stopping() {
+    lock_guard<mutex> guard(lock_);
+    return stop_;
+}
+
+void Worker::run() {
+    while (true) {
+        function<void()> job;
+        {
+            unique_lock<mutex> guard(lock_);
+            cond_.wait(guard, [this] { return stop_ || !jobs_.empty(); });
+            if (stop_) return;
+            job = jobs_.front();
+            jobs_.pop_front();
+        }
+        job();
+    }
+}
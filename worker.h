@@ -0,0 +1,32 @@
+#ifndef __GPHOTOFS2_WORKER_H_
+#define __GPHOTOFS2_WORKER_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// A background thread running jobs in submission order.
+class Worker {
+public:
+    Worker();
+    ~Worker();
+
+    void submit(std::function<void()> job);
+    // Drops pending jobs and waits for the running one to finish.
+    void stop();
+    // Long jobs should check this and bail out early.
+    bool stopping();
+
+private:
+    void run();
+
+    std::mutex lock_;
+    std::condition_variable cond_;
+    std::deque<std::function<void()>> jobs_;
+    bool stop_;
+    std::thread thread_;
+};
+
+#endif // __GPHOTOFS2_WORKER_H_